@@ -84,16 +84,7 @@ off_t alloc_rootdir_entry(DOS_FS * fs, DIR_ENT * de, const char *pattern, int ge
 	     * after previous one */
 	    if (!prev)
 		die("Root directory has no cluster allocated!");
-	    for (clu_num = prev + 1; clu_num != prev; clu_num++) {
-		FAT_ENTRY entry;
-
-		if (clu_num >= fs->data_clusters + 2)
-		    clu_num = 2;
-		get_fat(&entry, fs->fat, clu_num, fs);
-		if (!entry.value)
-		    break;
-	    }
-	    if (clu_num == prev)
+	    if (!(clu_num = find_free(fs, prev + 1, 1)))
 		die("Root directory full and no free cluster");
 	    set_fat(fs, prev, clu_num);
 	    set_fat(fs, clu_num, -1);
@@ -412,8 +403,10 @@ static void read_fsinfo(DOS_FS * fs, struct boot_sector *b, unsigned int lss)
 	    fs->fsinfo_start = 0;
     }
 
-    if (fs->fsinfo_start)
+    if (fs->fsinfo_start) {
 	fs->free_clusters = le32toh(i.free_clusters);
+	fs->free_hint = le32toh(i.next_cluster);
+    }
 }
 
 void read_boot(DOS_FS * fs)
@@ -438,11 +431,12 @@ void read_boot(DOS_FS * fs)
 	die("Logical sector size (%u bytes) is not a multiple of the physical "
 	    "sector size.", logical_sector_size);
 
+    fs->sector_size = logical_sector_size;
     fs->cluster_size = b.cluster_size * logical_sector_size;
     if (!fs->cluster_size)
 	die("Cluster size is zero.");
-    if (b.fats != 2 && b.fats != 1)
-	die("Currently, only 1 or 2 FATs are supported, not %d.\n", b.fats);
+    if (!b.fats)
+	die("Number of FATs is zero.");
     fs->nfats = b.fats;
     sectors = GET_UNALIGNED_W(b.sectors);
     total_sectors = sectors ? sectors : le32toh(b.total_sect);
@@ -461,7 +455,7 @@ void read_boot(DOS_FS * fs)
 	die("FAT size is zero.");
 
     fs->fat_start = (off_t)le16toh(b.reserved) * logical_sector_size;
-    position = (le16toh(b.reserved) + b.fats * fat_length) *
+    position = (le16toh(b.reserved) + (long long)b.fats * fat_length) *
 	logical_sector_size;
     if (position > OFF_MAX)
 	die("Filesystem is too large.");
@@ -484,6 +478,7 @@ void read_boot(DOS_FS * fs)
     fs->root_cluster = 0;	/* indicates standard, pre-FAT32 root dir */
     fs->fsinfo_start = 0;	/* no FSINFO structure */
     fs->free_clusters = -1;	/* unknown */
+    fs->free_hint = -1;		/* unknown */
     if (!b.fat_length && b.fat32_length) {
 	fs->fat_bits = 32;
 	fs->root_cluster = le32toh(b.root_cluster);
@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <wctype.h>
+#include <sys/time.h>
 
 #include "common.h"
 #include "fsck.fat.h"
@@ -43,13 +44,49 @@
 #include "check.h"
 #include "boot.h"
 #include "charconv.h"
+#include "readahead.h"
 
 
 /* the longest path on the filesystem that can be handled by path_name() */
 #define PATH_NAME_MAX 1023
 
+/* Largest number of bytes of an extent test_file() reads at once */
+#define TEST_RUN (1024 * 1024)
+
 static DOS_FILE *root;
 
+/* Files that own clusters, in the order they were checked */
+static DOS_FILE **owners;
+static unsigned int owners_count, owners_max;
+
+/*
+ * A repair that changes a directory whose entries were read already makes
+ * the scan unwind to the closest directory holding both the changed one and
+ * the file being checked, and scan its tree again; NULL stands for the root
+ * directory. Everything outside of that tree and the FAT in memory are kept.
+ * scan_root() reports the scan to be restarted, so that the whole filesystem
+ * is checked once more after all repairs.
+ */
+static DOS_FILE *restart_dir;
+static unsigned int restarts, rescans_active;
+static struct timeval rescan_start;
+static double rescan_seconds;
+
+/* Short names of the entries of the directory check_dir() works on, hashed
+ * into buckets. Nodes are numbered from 1, 0 ends a bucket. */
+typedef struct {
+    DOS_FILE *file;
+    uint32_t order;		/* position of the entry in the directory */
+    uint32_t next;		/* next node in the same bucket */
+} NAME_NODE;
+
+typedef struct {
+    NAME_NODE *node;
+    uint32_t *bucket;
+    uint32_t mask;		/* number of buckets - 1 */
+    uint32_t number;		/* all FSCKnnnnnnn names below it are taken */
+} NAME_INDEX;
+
 /* get start field of a dir entry */
 #define FSTART(p,fs) \
   ((uint32_t)le16toh(p->dir_ent.start) | \
@@ -85,6 +122,36 @@ static DOS_FILE *root;
     }									\
   } while(0)
 
+/* Returns the name of FILE as it appears in its path. */
+static const char *entry_name(DOS_FILE * file)
+{
+    return file->lfn ? file->lfn : file_name(file->dir_ent.name);
+}
+
+/*
+ * The path of the directory whose entries were last named by path_name().
+ * The entries of a directory are reported together while it is scanned, so
+ * the path of the directory is built once and then only the name of each
+ * entry is appended. The name of a directory does not change once its
+ * entries have been read, except when check_dir() drops it. scan_root()
+ * starts over with a new tree.
+ */
+static DOS_FILE *path_dir;
+static int path_dir_set;
+static char dir_path[PATH_NAME_MAX * 2];
+static size_t dir_path_length;
+
+/* Appends "/" and NAME to the path in BUFFER of LENGTH characters, without
+ * the slash if the path is "/" already (the FAT32 root directory entry), and
+ * returns the new length. */
+static size_t append_name(char *buffer, size_t length, const char *name)
+{
+    if (length != 1 || *buffer != '/')
+	buffer[length++] = '/';
+    strcpy(buffer + length, name);
+    return length + strlen(name);
+}
+
 /**
  * Construct a full path (starting with '/') for the specified dentry,
  * relative to the partition. All components are "long" names where possible.
@@ -96,21 +163,36 @@ static DOS_FILE *root;
 static char *path_name(DOS_FILE * file)
 {
     static char path[PATH_NAME_MAX * 2];
+    static DOS_FILE *dirs[PATH_NAME_MAX + 1];
+    DOS_FILE *walk;
+    int depth;
 
-    if (!file)
+    if (!file) {
 	*path = 0;		/* Reached the root directory */
-    else {
-	if (strlen(path_name(file->parent)) > PATH_NAME_MAX)
-	    die("Path name too long.");
-	if (strcmp(path, "/") != 0)
-	    strcat(path, "/");
-
-	/* Append the long name to the path,
-	 * or the short name if there isn't a long one
-	 */
-	strcpy(strrchr(path, 0),
-	       file->lfn ? file->lfn : file_name(file->dir_ent.name));
+	return path;
+    }
+    if (!path_dir_set || path_dir != file->parent) {
+	/* Every directory adds at least a slash, so a deeper path would be
+	 * too long anyway */
+	for (depth = 0, walk = file->parent; walk; walk = walk->parent) {
+	    if (depth > PATH_NAME_MAX)
+		die("Path name too long.");
+	    dirs[depth++] = walk;
+	}
+	*dir_path = 0;
+	for (dir_path_length = 0; depth--;)
+	    if ((dir_path_length = append_name(dir_path, dir_path_length,
+					       entry_name(dirs[depth]))) >
+		PATH_NAME_MAX)
+		die("Path name too long.");
+	path_dir = file->parent;
+	path_dir_set = 1;
     }
+    /* Append the long name to the path,
+     * or the short name if there isn't a long one
+     */
+    memcpy(path, dir_path, dir_path_length);
+    append_name(path, dir_path_length, entry_name(file));
     return path;
 }
 
@@ -227,12 +309,18 @@ static void drop_file(DOS_FS * fs, DOS_FILE * file)
 static void truncate_file(DOS_FS * fs, DOS_FILE * file, uint32_t clusters)
 {
     int deleting;
-    uint32_t walk, next;
+    uint32_t walk, next, run;
 
     walk = FSTART(file, fs);
     if ((deleting = !clusters))
 	MODIFY_START(file, 0, fs);
     while (walk > 0 && walk != -1) {
+	/* Skip the extents that are kept as a whole */
+	if (!deleting && (run = chain_run(fs, walk)) - walk + 1 < clusters) {
+	    clusters -= run - walk + 1;
+	    walk = next_cluster(fs, run);
+	    continue;
+	}
 	next = next_cluster(fs, walk);
 	if (deleting)
 	    set_fat(fs, walk, 0);
@@ -242,28 +330,162 @@ static void truncate_file(DOS_FS * fs, DOS_FILE * file, uint32_t clusters)
     }
 }
 
-static void auto_rename(DOS_FILE * file)
+static uint32_t name_hash(const uint8_t *name)
+{
+    uint32_t hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < MSDOS_NAME; i++)
+	hash = (hash ^ name[i]) * 16777619U;
+    return hash;
+}
+
+/* Returns the number of an FSCKnnnnnnn name, or 0xFFFFFFFF for other names. */
+static uint32_t rename_number(const uint8_t *name)
+{
+    uint32_t number = 0;
+    int i;
+
+    if (memcmp(name, "FSCK", 4))
+	return 0xFFFFFFFF;
+    for (i = 4; i < MSDOS_NAME; i++) {
+	if (name[i] < '0' || name[i] > '9')
+	    return 0xFFFFFFFF;
+	number = number * 10 + name[i] - '0';
+    }
+    return number;
+}
+
+/* Adds node N to the bucket of the current name of its file. */
+static void link_name(NAME_INDEX * index, uint32_t n)
+{
+    uint32_t *head =
+	&index->bucket[name_hash(index->node[n].file->dir_ent.name) &
+		       index->mask];
+
+    index->node[n].next = *head;
+    *head = n;
+}
+
+/* Removes the node of FILE from the index and returns its number. Call it
+ * before the name of FILE changes and link_name() after. */
+static uint32_t unlink_name(NAME_INDEX * index, DOS_FILE * file)
+{
+    uint32_t *link = &index->bucket[name_hash(file->dir_ent.name) &
+				    index->mask];
+    uint32_t n, number;
+
+    while ((n = *link) && index->node[n].file != file)
+	link = &index->node[n].next;
+    if (!n)
+	die("Internal error: %s is not in the name index",
+	    file_name(file->dir_ent.name));
+    *link = index->node[n].next;
+    /* The number this name had is free again */
+    if ((number = rename_number(file->dir_ent.name)) < index->number)
+	index->number = number;
+    return n;
+}
+
+/* Builds the index of the entries of the directory starting at FIRST. */
+static void index_names(NAME_INDEX * index, DOS_FILE * first)
+{
+    DOS_FILE *walk;
+    uint32_t count = 0, size = 1;
+
+    for (walk = first; walk; walk = walk->next)
+	count++;
+    while (size < count)
+	size *= 2;
+    index->node = alloc((count + 1) * sizeof(NAME_NODE));
+    index->bucket = alloc(size * sizeof(uint32_t));
+    memset(index->bucket, 0, size * sizeof(uint32_t));
+    index->mask = size - 1;
+    index->number = 0;
+    for (count = 0, walk = first; walk; walk = walk->next) {
+	index->node[++count].file = walk;
+	index->node[count].order = count;
+	link_name(index, count);
+    }
+}
+
+static void free_names(NAME_INDEX * index)
 {
-    DOS_FILE *first, *walk;
-    uint32_t number;
+    free(index->node);
+    free(index->bucket);
+}
+
+/* Returns the first entry after position AFTER in the directory that is not
+ * a volume label and has the same name as FILE, and stores its position in
+ * AFTER. Returns NULL if there is none. */
+static DOS_FILE *next_duplicate(NAME_INDEX * index, DOS_FILE * file,
+				uint32_t * after)
+{
+    NAME_NODE *node;
+    DOS_FILE *found = NULL;
+    uint32_t n, order = 0;
+
+    for (n = index->bucket[name_hash(file->dir_ent.name) & index->mask]; n;
+	 n = node->next) {
+	node = &index->node[n];
+	if (node->order > *after && (!found || node->order < order) &&
+	    !(node->file->dir_ent.attr & ATTR_VOLUME) &&
+	    !memcmp(node->file->dir_ent.name, file->dir_ent.name,
+		    MSDOS_NAME)) {
+	    found = node->file;
+	    order = node->order;
+	}
+    }
+    if (found)
+	*after = order;
+    return found;
+}
+
+/* Returns the position of FILE in the directory. */
+static uint32_t name_order(NAME_INDEX * index, DOS_FILE * file)
+{
+    uint32_t n = index->bucket[name_hash(file->dir_ent.name) & index->mask];
+
+    while (n && index->node[n].file != file)
+	n = index->node[n].next;
+    if (!n)
+	die("Internal error: %s is not in the name index",
+	    file_name(file->dir_ent.name));
+    return index->node[n].order;
+}
+
+static int name_taken(NAME_INDEX * index, const uint8_t *name)
+{
+    uint32_t n = index->bucket[name_hash(name) & index->mask];
+
+    for (; n; n = index->node[n].next)
+	if (!memcmp(index->node[n].file->dir_ent.name, name, MSDOS_NAME))
+	    return 1;
+    return 0;
+}
+
+static void auto_rename(NAME_INDEX * index, DOS_FILE * file)
+{
+    uint32_t n, number;
 
     if (!file->offset) {
 	printf("Cannot rename FAT32 root dir\n");
 	return;			/* cannot rename FAT32 root dir */
     }
-    first = file->parent ? file->parent->first : root;
-    number = 0;
+    /* The names below index->number are all taken by other entries */
+    n = unlink_name(index, file);
+    number = index->number;
     while (1) {
 	char num[8];
+	if (number > 9999999) {
+	    die("Too many files need repair.");
+	}
 	sprintf(num, "%07lu", (unsigned long)number);
 	memcpy(file->dir_ent.name, "FSCK", 4);
 	memcpy(file->dir_ent.name + 4, num, 7);
-	for (walk = first; walk; walk = walk->next)
-	    if (walk != file
-		&& !strncmp((const char *)walk->dir_ent.name,
-			    (const char *)file->dir_ent.name, MSDOS_NAME))
-		break;
-	if (!walk) {
+	if (!name_taken(index, file->dir_ent.name)) {
+	    link_name(index, n);
+	    index->number = number + 1;
 	    fs_write(file->offset, MSDOS_NAME, file->dir_ent.name);
 	    if (file->lfn) {
 		lfn_remove(file->lfn_offset, file->offset);
@@ -272,17 +494,16 @@ static void auto_rename(DOS_FILE * file)
 	    return;
 	}
 	number++;
-	if (number > 9999999) {
-	    die("Too many files need repair.");
-	}
     }
     die("Can't generate a unique name.");
 }
 
-static void rename_file(DOS_FILE * file)
+static void rename_file(NAME_INDEX * index, DOS_FILE * file)
 {
     unsigned char name[46];
     unsigned char *walk, *here;
+    uint32_t n;
+    int converted;
 
     if (!file->offset) {
 	printf("Cannot rename FAT32 root dir\n");
@@ -296,7 +517,10 @@ static void rename_file(DOS_FILE * file)
 		 walk >= name && (*walk == ' ' || *walk == '\t'); walk--) ;
 	    walk[1] = 0;
 	    for (walk = name; *walk == ' ' || *walk == '\t'; walk++) ;
-	    if (file_cvt(walk, file->dir_ent.name)) {
+	    n = unlink_name(index, file);
+	    converted = file_cvt(walk, file->dir_ent.name);
+	    link_name(index, n);
+	    if (converted) {
 		fs_write(file->offset, MSDOS_NAME, file->dir_ent.name);
 		if (file->lfn) {
 		    lfn_remove(file->lfn_offset, file->offset);
@@ -310,24 +534,39 @@ static void rename_file(DOS_FILE * file)
 
 static uint32_t scan_free_entry(DOS_FS * fs, DOS_FILE * this)
 {
-    uint32_t clu_num, offset;
-    int i;
-    DIR_ENT de;
+    uint32_t clu_num, offset = 0;
+    unsigned int i;
+    DIR_ENT *entries;
 
-    i = 2 * sizeof(DIR_ENT); /* Skip '.' and '..' slots */
+    entries = alloc(fs->cluster_size);
+    i = 2; /* Skip '.' and '..' slots */
     clu_num = FSTART(this, fs);
     while (clu_num > 0 && clu_num != -1) {
-	offset = cluster_start(fs, clu_num) + (i % fs->cluster_size);
-	fs_read(offset, sizeof(DIR_ENT), &de);
-	if (IS_FREE(de.name))
-	    return offset;
-	i += sizeof(DIR_ENT);
-	if (!(i % fs->cluster_size))
-	    if ((clu_num = next_cluster(fs, clu_num)) == 0 || clu_num == -1)
-		break;
+	fs_read(cluster_start(fs, clu_num), fs->cluster_size, entries);
+	for (; i < fs->cluster_size / sizeof(DIR_ENT); i++)
+	    if (IS_FREE(entries[i].name)) {
+		offset = cluster_start(fs, clu_num) + i * sizeof(DIR_ENT);
+		goto found;
+	    }
+	i = 0;
+	clu_num = next_cluster(fs, clu_num);
     }
 
-    return 0;
+found:
+    free(entries);
+    return offset;
+}
+
+/* Returns the cluster the '..' entry of directory DIR has to point to, the
+ * first cluster of its parent or 0 for the root directory. */
+static uint32_t parent_start(DOS_FS * fs, DOS_FILE * dir)
+{
+    uint32_t start;
+
+    if (!dir->parent)
+	return 0;
+    start = FSTART(dir->parent, fs);
+    return start == fs->root_cluster ? 0 : start;
 }
 
 static int handle_dot(DOS_FS * fs, DOS_FILE * file, int dotdot)
@@ -338,13 +577,7 @@ static int handle_dot(DOS_FS * fs, DOS_FILE * file, int dotdot)
     if (dotdot) {
 	name = "..";
 	ent = MSDOS_DOTDOT;
-	if (!file->parent->parent) {
-	    start = 0;
-	} else {
-	    start = FSTART(file->parent->parent, fs);
-	    if (start == fs->root_cluster)
-		start = 0;
-	}
+	start = parent_start(fs, file->parent);
     } else {
 	name = ".";
 	ent = MSDOS_DOT;
@@ -412,11 +645,138 @@ conjure:
     return 0;
 }
 
+static void add_owner(DOS_FILE * file)
+{
+    DOS_FILE **grown;
+
+    if (owners_count == owners_max) {
+	owners_max = owners_max ? owners_max * 2 : 1024;
+	grown = alloc(owners_max * sizeof(DOS_FILE *));
+	if (owners_count)
+	    memcpy(grown, owners, owners_count * sizeof(DOS_FILE *));
+	free(owners);
+	owners = grown;
+    }
+    owners[owners_count++] = file;
+}
+
+/* Gives up the clusters claimed by FILE. A file that has been checked ends
+ * before the first cluster of any other file, and the one being checked has
+ * claimed its clusters up to such a cluster. */
+static void release_chain(DOS_FS * fs, DOS_FILE * file)
+{
+    uint32_t walk, run, steps;
+
+    for (walk = FSTART(file, fs), steps = 0;
+	 walk > 1 && walk < fs->data_clusters + 2 && steps < fs->data_clusters;
+	 walk = next_cluster(fs, run), steps++) {
+	run = chain_run(fs, walk);
+	set_owner_run(fs, walk, run, OWNER_NONE);
+	if (bad_cluster(fs, run))
+	    break;
+    }
+}
+
+/* Releases the clusters of FILE, which has been dropped, and forgets it as
+ * their owner. */
+static void drop_owner(DOS_FS * fs, DOS_FILE * file)
+{
+    unsigned int i;
+
+    for (i = owners_count; i--;)
+	if (owners[i] == file) {
+	    release_chain(fs, file);
+	    memmove(owners + i, owners + i + 1,
+		    (--owners_count - i) * sizeof(DOS_FILE *));
+	    break;
+	}
+}
+
+/* Picks the tree holding both OWNER, whose chain has just been cut, and
+ * FILE, which is being checked, to be scanned again. */
+static void restart_scan(DOS_FILE * owner, DOS_FILE * file)
+{
+    DOS_FILE *walk;
+
+    for (restart_dir = file->parent; restart_dir;
+	 restart_dir = restart_dir->parent) {
+	for (walk = owner; walk && walk != restart_dir; walk = walk->parent) ;
+	if (walk)
+	    break;
+    }
+}
+
+/* Prepares to scan the tree of DIR again, forgetting the files found in it
+ * since MARK files owned clusters. */
+static void restart_tree(DOS_FS * fs, DOS_FILE * dir, unsigned int mark)
+{
+    while (owners_count > mark)
+	release_chain(fs, owners[--owners_count]);
+    if (dir)
+	dir->first = NULL;
+    else
+	root = NULL;
+    path_dir_set = 0;
+    restarts++;
+}
+
+static void begin_rescan(void)
+{
+    if (!rescans_active++)
+	gettimeofday(&rescan_start, NULL);
+}
+
+static void end_rescan(void)
+{
+    struct timeval now;
+
+    if (!--rescans_active) {
+	gettimeofday(&now, NULL);
+	rescan_seconds += now.tv_sec - rescan_start.tv_sec +
+	    (now.tv_usec - rescan_start.tv_usec) / 1e6;
+    }
+}
+
+/**
+ * Find the file that owns a cluster.
+ *
+ * Only the kind of ownership is recorded for each cluster, so this follows
+ * the chains of the files that own clusters, in the order in which they were
+ * checked. The first file whose chain contains the cluster is the one that
+ * claimed it. Cross-links are rare, so this is cheaper than remembering the
+ * owner of every cluster.
+ *
+ * @param[in]   fs          Information about the filesystem
+ * @param[in]   cluster     Cluster owned by a checked file
+ *
+ * @return  The owner of CLUSTER
+ */
+static DOS_FILE *find_owner(DOS_FS * fs, uint32_t cluster)
+{
+    uint32_t walk, run, steps;
+    unsigned int i;
+
+    /* Only the last cluster of an extent can be bad or end the chain */
+    for (i = 0; i < owners_count; i++)
+	for (walk = FSTART(owners[i], fs), steps = 0;
+	     walk > 1 && walk < fs->data_clusters + 2 &&
+	     steps < fs->data_clusters; walk = next_cluster(fs, run), steps++) {
+	    run = chain_run(fs, walk);
+	    if (cluster >= walk && cluster <= run)
+		return owners[i];
+	    if (bad_cluster(fs, run))
+		break;
+	}
+    die("Internal error: owner of cluster %lu not found",
+	(unsigned long)cluster);
+}
+
 static int check_file(DOS_FS * fs, DOS_FILE * file)
 {
     DOS_FILE *owner;
     int restart;
     uint32_t parent, grandp, curr, this, clusters, prev, walk, clusters2;
+    uint32_t run, count, needed;
 
     if (IS_FREE(file->dir_ent.name))
 	return 0;
@@ -474,9 +834,34 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 	MODIFY_START(file, 0, fs);
     }
     clusters = prev = 0;
+    if (FSTART(file, fs))
+	add_owner(file);
+    /* Clusters the file size needs; the chain is truncated at the next one */
+    needed = (le32toh(file->dir_ent.size) + (uint64_t)fs->cluster_size - 1) /
+	fs->cluster_size;
     for (curr = FSTART(file, fs) ? FSTART(file, fs) :
 	 -1; curr != -1; curr = next_cluster(fs, curr)) {
 	FAT_ENTRY curEntry;
+
+	/* All clusters of an extent but the last link on, so they are
+	 * neither free nor bad. Claim those the size and cross-link checks
+	 * below would let pass in one go. */
+	run = chain_run(fs, curr);
+	count = find_owned(fs, curr, run) - curr;
+	if (count > run - curr)
+	    count = run - curr;
+	if (!(file->dir_ent.attr & ATTR_DIR) && clusters + count > needed)
+	    count = needed > clusters ? needed - clusters : 0;
+	if (count) {
+	    if ((unsigned long long)(clusters + count - 1) *
+		fs->cluster_size >= UINT32_MAX)
+		die("Internal error: Cluster chain is larger than 2^32");
+	    set_owner_run(fs, curr, curr + count - 1, OWNER_FILE);
+	    clusters += count;
+	    prev = curr + count - 1;
+	    curr += count;
+	}
+
 	get_fat(&curEntry, fs->fat, curr, fs);
 
 	if (!curEntry.value || bad_cluster(fs, curr)) {
@@ -505,20 +890,24 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 	    truncate_file(fs, file, clusters);
 	    break;
 	}
-	if ((owner = get_owner(fs, curr))) {
+	if (get_owner(fs, curr)) {
 	    int do_trunc = 0;
+	    owner = find_owner(fs, curr);
 	    printf("%s  and\n", path_name(owner));
 	    printf("%s\n  share clusters.\n", path_name(file));
 	    clusters2 = 0;
 	    for (walk = FSTART(owner, fs); walk > 0 && walk != -1; walk =
-		 next_cluster(fs, walk))
-		if (walk == curr)
+		 next_cluster(fs, run)) {
+		run = chain_run(fs, walk);
+		count = curr >= walk && curr <= run ? curr - walk :
+		    run - walk + 1;
+		if (count && (unsigned long long)(clusters2 + count - 1) *
+		    fs->cluster_size >= UINT32_MAX)
+		    die("Internal error: Cluster chain is larger than 2^32");
+		clusters2 += count;
+		if (curr >= walk && curr <= run)
 		    break;
-		else {
-		    if ((unsigned long long)clusters2 * fs->cluster_size >= UINT32_MAX)
-		        die("Internal error: Cluster chain is larger than 2^32");
-		    clusters2++;
-		}
+	    }
 	    restart = file->dir_ent.attr & ATTR_DIR;
 	    if (!owner->offset) {
 		printf("  Truncating second to %llu bytes (%u clusters) "
@@ -570,12 +959,14 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 				MODIFY(owner, size, htole32(UINT32_MAX));
 			else
 				MODIFY(owner, size, htole32(clusters * fs->cluster_size));
-			if (restart)
-			    return 1;
 			while (this > 0 && this != -1) {
-			    set_owner(fs, this, NULL);
+			    set_owner(fs, this, OWNER_NONE);
 			    this = next_cluster(fs, this);
 			}
+			if (restart) {
+			    restart_scan(owner, file);
+			    return 1;
+			}
 			this = curr;
 			break;
 		    }
@@ -595,7 +986,7 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 		break;
 	    }
 	}
-	set_owner(fs, curr, file);
+	set_owner(fs, curr, OWNER_FILE);
 	if ((unsigned long long)clusters * fs->cluster_size >= UINT32_MAX)
 	    die("Internal error: Cluster chain is larger than 2^32");
 	clusters++;
@@ -633,7 +1024,9 @@ static int check_files(DOS_FS * fs, DOS_FILE * start)
 
 static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 {
-    DOS_FILE *parent, **walk, **scan;
+    DOS_FILE *parent, **walk, **scan, *dup;
+    NAME_INDEX index;
+    uint32_t n, order;
     int skip, redo;
     int good, bad;
 
@@ -657,10 +1050,14 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 			    2, "Keep directory") == 1) {
 	    truncate_file(fs, parent, 0);
 	    MODIFY(parent, name[0], DELETED_FLAG);
+	    path_dir_set = 0;
 	    /* buglet: deleted directory stays in the list. */
 	    return 1;
 	}
     }
+    /* Duplicates are looked up by name instead of comparing all pairs, the
+     * index follows every name change and removal below */
+    index_names(&index, *root);
     redo = 0;
     walk = root;
     while (*walk) {
@@ -675,15 +1072,17 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 			       3, "Auto-rename",
 			       4, "Keep it")) {
 	    case 1:
+		n = unlink_name(&index, *walk);
 		drop_file(fs, *walk);
+		link_name(&index, n);
 		walk = &(*walk)->next;
 		continue;
 	    case 2:
-		rename_file(*walk);
+		rename_file(&index, *walk);
 		redo = 1;
 		break;
 	    case 3:
-		auto_rename(*walk);
+		auto_rename(&index, *walk);
 		printf("  Renamed to %s\n", file_name((*walk)->dir_ent.name));
 		break;
 	    case 4:
@@ -692,55 +1091,54 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 	}
 	/* don't check for duplicates of the volume label */
 	if (!((*walk)->dir_ent.attr & ATTR_VOLUME)) {
-	    scan = &(*walk)->next;
+	    order = name_order(&index, *walk);
 	    skip = 0;
-	    while (*scan && !skip) {
-		if (!((*scan)->dir_ent.attr & ATTR_VOLUME) &&
-		    !memcmp((*walk)->dir_ent.name, (*scan)->dir_ent.name,
-			    MSDOS_NAME)) {
-		    printf("%s\n  Duplicate directory entry.\n  First  %s\n",
-			   path_name(*walk), file_stat(*walk));
-		    printf("  Second %s\n", file_stat(*scan));
-		    switch (get_choice(6, "  Auto-renaming second.",
-				       6,
-				       1, "Drop first",
-				       2, "Drop second",
-				       3, "Rename first",
-				       4, "Rename second",
-				       5, "Auto-rename first",
-				       6, "Auto-rename second")) {
-		    case 1:
-			drop_file(fs, *walk);
-			*walk = (*walk)->next;
-			skip = 1;
-			break;
-		    case 2:
-			drop_file(fs, *scan);
-			*scan = (*scan)->next;
-			continue;
-		    case 3:
-			rename_file(*walk);
-			printf("  Renamed to %s\n", path_name(*walk));
-			redo = 1;
-			break;
-		    case 4:
-			rename_file(*scan);
-			printf("  Renamed to %s\n", path_name(*walk));
-			redo = 1;
-			break;
-		    case 5:
-			auto_rename(*walk);
-			printf("  Renamed to %s\n",
-			       file_name((*walk)->dir_ent.name));
-			break;
-		    case 6:
-			auto_rename(*scan);
-			printf("  Renamed to %s\n",
-			       file_name((*scan)->dir_ent.name));
-			break;
-		    }
+	    while (!skip && (dup = next_duplicate(&index, *walk, &order))) {
+		printf("%s\n  Duplicate directory entry.\n  First  %s\n",
+		       path_name(*walk), file_stat(*walk));
+		printf("  Second %s\n", file_stat(dup));
+		switch (get_choice(6, "  Auto-renaming second.",
+				   6,
+				   1, "Drop first",
+				   2, "Drop second",
+				   3, "Rename first",
+				   4, "Rename second",
+				   5, "Auto-rename first",
+				   6, "Auto-rename second")) {
+		case 1:
+		    unlink_name(&index, *walk);
+		    drop_file(fs, *walk);
+		    *walk = (*walk)->next;
+		    skip = 1;
+		    break;
+		case 2:
+		    unlink_name(&index, dup);
+		    drop_file(fs, dup);
+		    for (scan = &(*walk)->next; *scan != dup;
+			 scan = &(*scan)->next) ;
+		    *scan = dup->next;
+		    break;
+		case 3:
+		    rename_file(&index, *walk);
+		    printf("  Renamed to %s\n", path_name(*walk));
+		    redo = 1;
+		    break;
+		case 4:
+		    rename_file(&index, dup);
+		    printf("  Renamed to %s\n", path_name(*walk));
+		    redo = 1;
+		    break;
+		case 5:
+		    auto_rename(&index, *walk);
+		    printf("  Renamed to %s\n",
+			   file_name((*walk)->dir_ent.name));
+		    break;
+		case 6:
+		    auto_rename(&index, dup);
+		    printf("  Renamed to %s\n",
+			   file_name(dup->dir_ent.name));
+		    break;
 		}
-		scan = &(*scan)->next;
 	    }
 	    if (skip)
 		continue;
@@ -752,6 +1150,7 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 	    redo = 0;
 	}
     }
+    free_names(&index);
     return 0;
 }
 
@@ -766,32 +1165,53 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
  */
 static void test_file(DOS_FS * fs, DOS_FILE * file, int read_test)
 {
-    DOS_FILE *owner;
-    uint32_t walk, prev, clusters, next_clu;
+    uint32_t walk, prev, clusters, next_clu, entry, run, count;
 
-    prev = clusters = 0;
+    prev = clusters = entry = 0;
     for (walk = FSTART(file, fs); walk > 1 && walk < fs->data_clusters + 2;
 	 walk = next_clu) {
+	/* Outside of cycles, pass the clusters of an extent that link on and
+	 * have no owner in one go, reading them at once for the read test */
+	if (!entry && (run = chain_run(fs, walk)) > walk) {
+	    count = find_owned(fs, walk, run - 1) - walk;
+	    if (count)
+		count = find_cyclic(fs, walk, walk + count - 1) - walk;
+	    if (read_test) {
+		if (count > TEST_RUN / fs->cluster_size)
+		    count = TEST_RUN / fs->cluster_size;
+		if (count && !fs_test(cluster_start(fs, walk),
+				      count * fs->cluster_size))
+		    count = 0;
+	    }
+	    if (count) {
+		clusters += count;
+		prev = walk + count - 1;
+		walk += count;
+	    }
+	}
 	next_clu = next_cluster(fs, walk);
 
 	/* In this stage we are checking only for a loop within our own
-	 * cluster chain.
+	 * cluster chain. read_fat() has found the clusters on cycles, so
+	 * the chain loops if it gets back to the first of them it entered.
 	 * Cross-linking of clusters is handled in check_file()
 	 */
-	if ((owner = get_owner(fs, walk))) {
-	    if (owner == file) {
-		printf("%s\n  Circular cluster chain. Truncating to %lu "
-		       "cluster%s.\n", path_name(file), (unsigned long)clusters,
-		       clusters == 1 ? "" : "s");
-		if (prev)
-		    set_fat(fs, prev, -1);
-		else if (!file->offset)
-		    die("Bad FAT32 root directory! (bad start cluster)\n");
-		else
-		    MODIFY_START(file, 0, fs);
-	    }
+	if (walk == entry) {
+	    printf("%s\n  Circular cluster chain. Truncating to %lu "
+		   "cluster%s.\n", path_name(file), (unsigned long)clusters,
+		   clusters == 1 ? "" : "s");
+	    if (prev)
+		set_fat(fs, prev, -1);
+	    else if (!file->offset)
+		die("Bad FAT32 root directory! (bad start cluster)\n");
+	    else
+		MODIFY_START(file, 0, fs);
 	    break;
 	}
+	if (get_owner(fs, walk))
+	    break;
+	if (!entry && cyclic_cluster(fs, walk))
+	    entry = walk;
 	if (bad_cluster(fs, walk))
 	    break;
 	if (read_test) {
@@ -806,27 +1226,24 @@ static void test_file(DOS_FS * fs, DOS_FILE * file, int read_test)
 		else
 		    MODIFY_START(file, next_cluster(fs, walk), fs);
 		set_fat(fs, walk, -2);
+		/* The cluster has left the chain, and with it any cycle.
+		 * Keep it claimed, like a cluster of a file that has been
+		 * checked. */
+		set_owner(fs, walk, OWNER_FILE);
+		if (walk == entry)
+		    entry = 0;
+		continue;
 	    }
 	} else {
 	    prev = walk;
 	    clusters++;
 	}
-	set_owner(fs, walk, file);
     }
-    /* Revert ownership (for now) */
-    for (walk = FSTART(file, fs); walk > 1 && walk < fs->data_clusters + 2;
-	 walk = next_cluster(fs, walk))
-	if (bad_cluster(fs, walk))
-	    break;
-	else if (get_owner(fs, walk) == file)
-	    set_owner(fs, walk, NULL);
-	else
-	    break;
 }
 
 static void undelete(DOS_FS * fs, DOS_FILE * file)
 {
-    uint32_t clusters, left, prev, walk;
+    uint32_t clusters, left, prev, walk, last;
 
     clusters = left = (le32toh(file->dir_ent.size) + fs->cluster_size - 1) /
 	fs->cluster_size;
@@ -834,20 +1251,14 @@ static void undelete(DOS_FS * fs, DOS_FILE * file)
 
     walk = FSTART(file, fs);
 
-    while (left && (walk >= 2) && (walk < fs->data_clusters + 2)) {
-
-	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, walk, fs);
-
-	if (!curEntry.value)
-	    break;
-
-	left--;
-	if (prev)
-	    set_fat(fs, prev, walk);
-	prev = walk;
-	walk++;
-    }
+    /* The file gets the free clusters that follow its start cluster */
+    if (left && (walk >= 2) && (walk < fs->data_clusters + 2))
+	for (last = walk + free_run(fs, walk, left); walk < last; walk++) {
+	    left--;
+	    if (prev)
+		set_fat(fs, prev, walk);
+	    prev = walk;
+	}
     if (prev)
 	set_fat(fs, prev, -1);
     else
@@ -863,6 +1274,28 @@ static void new_dir(void)
     lfn_reset();
 }
 
+/**
+ * Append a file to the listing of its directory and count it.
+ *
+ * @param[inout]    chain   Where the listing goes on, moved past NEW
+ * @param[in]       new     File to append
+ */
+static void link_file(DOS_FILE *** chain, DOS_FILE * new)
+{
+    new->next = new->first = NULL;
+    **chain = new;
+    *chain = &new->next;
+    if (list) {
+	printf("Checking file %s", path_name(new));
+	if (new->lfn)
+	    printf(" (%s)", file_name(new->dir_ent.name));	/* (8.3) */
+	printf("\n");
+    }
+    /* Don't include root directory in the total file count */
+    if (new->offset)
+	++n_files;
+}
+
 /**
  * Create a description for a referenced dentry and insert it in our dentry
  * tree. Then, go check the dentry's cluster chain for bad clusters and
@@ -874,17 +1307,19 @@ static void new_dir(void)
  *                          NULL == no parent ('file' is root directory)
  * @param[in]       offset  Partition-relative byte offset of directory entry of interest
  *                          0 == Root directory
+ * @param[in]       entry   Directory entry at offset, as read by the caller
+ *                          NULL == FAT32 root directory, which has no entry
  * @param           cp
  */
 static void add_file(DOS_FS * fs, DOS_FILE *** chain, DOS_FILE * parent,
-		     off_t offset, FDSC ** cp)
+		     off_t offset, const DIR_ENT * entry, FDSC ** cp)
 {
     DOS_FILE *new;
     DIR_ENT de;
     FD_TYPE type;
 
     if (offset)
-	fs_read(offset, sizeof(DIR_ENT), &de);
+	de = *entry;
     else {
 	/* Construct a DIR_ENT for the root directory */
 	memset(&de, 0, sizeof de);
@@ -911,38 +1346,320 @@ static void add_file(DOS_FS * fs, DOS_FILE *** chain, DOS_FILE * parent,
     new->lfn = lfn_get(&de, &new->lfn_offset);
     new->offset = offset;
     memcpy(&new->dir_ent, &de, sizeof(de));
-    new->next = new->first = NULL;
     new->parent = parent;
     if (type == fdt_undelete)
 	undelete(fs, new);
-    **chain = new;
-    *chain = &new->next;
-    if (list) {
-	printf("Checking file %s", path_name(new));
-	if (new->lfn)
-	    printf(" (%s)", file_name(new->dir_ent.name));	/* (8.3) */
-	printf("\n");
-    }
-    /* Don't include root directory in the total file count */
-    if (offset)
-	++n_files;
+    link_file(chain, new);
     test_file(fs, new, test);	/* Bad cluster check */
 }
 
+/**
+ * Start reading the clusters of a directory before scan_dir() gets to them.
+ *
+ * @param[in]       fs      Information about the filesystem
+ * @param[in]       cluster First cluster to read
+ * @param[inout]    count   Maximum number of clusters to read, replaced by
+ *                          the number of clusters actually read
+ *
+ * @return  The cluster following the last one read, 0 at the end of the chain
+ */
+static uint32_t prefetch_chain(DOS_FS * fs, uint32_t cluster, int *count)
+{
+    off_t pos[PREFETCH_MAX];
+    FAT_ENTRY entry;
+    int n;
+
+    for (n = 0; n < *count && cluster >= 2 &&
+	 cluster < fs->data_clusters + 2; n++) {
+	pos[n] = cluster_start(fs, cluster);
+	get_fat(&entry, fs->fat, cluster, fs);
+	if (FAT_IS_BAD(fs, entry.value) || FAT_IS_EOF(fs, entry.value))
+	    cluster = 0;
+	else
+	    cluster = entry.value;
+    }
+    if (n)
+	fs_prefetch(pos, n, fs->cluster_size);
+    *count = n;
+    return n ? cluster : 0;
+}
+
+/**
+ * Start reading the first cluster of the next COUNT subdirectories in a
+ * directory listing.
+ *
+ * @param[in]       fs      Information about the filesystem
+ * @param[inout]    next    Where to continue in the listing, updated to the
+ *                          entry following the last subdirectory handled
+ * @param[in]       count   Number of subdirectories
+ */
+static void prefetch_dirs(DOS_FS * fs, DOS_FILE ** next, int count)
+{
+    off_t pos[PREFETCH_MAX];
+    DOS_FILE *walk;
+    uint32_t cluster;
+    int n;
+
+    for (n = 0, walk = *next; walk && n < count; walk = walk->next)
+	if (!IS_FREE(walk->dir_ent.name) && (walk->dir_ent.attr & ATTR_DIR)) {
+	    cluster = FSTART(walk, fs);
+	    if (cluster >= 2 && cluster < fs->data_clusters + 2)
+		pos[n++] = cluster_start(fs, cluster);
+	}
+    *next = walk;
+    if (n)
+	fs_prefetch(pos, n, fs->cluster_size);
+}
+
+/* Returns whether two entries of DIR other than volume labels have the same
+ * short name. */
+static int ahead_duplicates(AHEAD_DIR * dir)
+{
+    uint32_t *bucket, size = 1, mask, i, n;
+    const uint8_t *name;
+    int found = 0;
+
+    while (size < dir->files * 2)
+	size *= 2;
+    mask = size - 1;
+    /* Open addressing, with the entries numbered from 1 */
+    bucket = alloc(size * sizeof(uint32_t));
+    memset(bucket, 0, size * sizeof(uint32_t));
+    for (i = 0; i < dir->files && !found; i++) {
+	if (dir->file[i].dir_ent.attr & ATTR_VOLUME)
+	    continue;
+	name = dir->file[i].dir_ent.name;
+	for (n = name_hash(name) & mask; bucket[n]; n = (n + 1) & mask)
+	    if (!memcmp(dir->file[bucket[n] - 1].dir_ent.name, name,
+			MSDOS_NAME)) {
+		found = 1;
+		break;
+	    }
+	bucket[n] = i + 1;
+    }
+    free(bucket);
+    return found;
+}
+
+/**
+ * Find the extents of the cluster chain of a file for a read-ahead thread,
+ * and whether check_file() and test_file() would leave the file as it is,
+ * apart from clusters it shares with other files.
+ *
+ * @param[in]       fs      Information about the filesystem
+ * @param[inout]    dir     Directory of the file, gets the extents
+ * @param[inout]    file    File to check
+ * @param[inout]    max     Number of extents DIR has room for
+ *
+ * @return  0   The file needs repairs
+ * @return  1   The file is fine
+ */
+static int ahead_chain(DOS_FS * fs, AHEAD_DIR * dir, AHEAD_FILE * file,
+		       uint32_t * max)
+{
+    uint32_t curr, run, clusters, needed, size, *grown;
+    int is_dir = file->dir_ent.attr & ATTR_DIR;
+    FAT_ENTRY entry;
+
+    size = le32toh(file->dir_ent.size);
+    if (is_dir && (size || !file->start || file->start == dir->cluster ||
+		   file->start == dir->parent))
+	return 0;
+    if (file->start == 1 || file->start >= fs->data_clusters + 2)
+	return 0;
+    file->extent = dir->extents;
+    clusters = 0;
+    needed = (size + (uint64_t)fs->cluster_size - 1) / fs->cluster_size;
+    for (curr = file->start; curr;) {
+	/* The last cluster of an extent is the only one that can be free or
+	 * bad, clusters on cycles are left to test_file() */
+	run = chain_run(fs, curr);
+	if (find_cyclic(fs, curr, run) <= run)
+	    return 0;
+	get_fat(&entry, fs->fat, run, fs);
+	if (!entry.value || FAT_IS_BAD(fs, entry.value))
+	    return 0;
+	clusters += run - curr + 1;
+	if ((unsigned long long)(clusters - 1) * fs->cluster_size >=
+	    UINT32_MAX || (!is_dir && clusters > needed))
+	    return 0;
+	if (dir->extents == *max) {
+	    *max = *max ? *max * 2 : 64;
+	    grown = alloc(*max * 2 * sizeof(uint32_t));
+	    if (dir->extent) {
+		memcpy(grown, dir->extent, dir->extents * 2 * sizeof(uint32_t));
+		free(dir->extent);
+	    }
+	    dir->extent = grown;
+	}
+	dir->extent[dir->extents * 2] = curr;
+	dir->extent[dir->extents * 2 + 1] = run;
+	dir->extents++;
+	file->extents++;
+	if (FAT_IS_EOF(fs, entry.value))
+	    break;
+	if (entry.value < 2)
+	    return 0;
+	curr = entry.value;
+    }
+    return is_dir || clusters == needed;
+}
+
+/**
+ * Parse a directory in a read-ahead thread. Everything scan_dir() would
+ * repair or report makes the directory unclean, only the clusters the files
+ * share with others are left for the check to find.
+ *
+ * @param[in]       fs      Information about the filesystem
+ * @param[inout]    dir     Directory to parse
+ * @param[in]       entries Entries of all clusters of the directory
+ * @param[in]       count   Number of entries
+ */
+static void parse_dir(DOS_FS * fs, AHEAD_DIR * dir, const DIR_ENT * entries,
+		      int count)
+{
+    DOS_FILE entry, *file = &entry;
+    AHEAD_FILE *new;
+    uint32_t cluster, max = 0;
+    off_t lfn_offset = 0;
+    int i, first = 0, slots = 0, per_cluster;
+
+    per_cluster = fs->cluster_size / sizeof(DIR_ENT);
+    dir->file = alloc(count * sizeof(AHEAD_FILE));
+    /* The root directory has no dot entries */
+    if (dir->cluster != fs->root_cluster) {
+	file->dir_ent = entries[0];
+	if (!(file->dir_ent.attr & ATTR_DIR) ||
+	    FSTART(file, fs) != dir->cluster ||
+	    memcmp(file->dir_ent.name, MSDOS_DOT, MSDOS_NAME))
+	    return;
+	file->dir_ent = entries[1];
+	if (!(file->dir_ent.attr & ATTR_DIR) ||
+	    FSTART(file, fs) != dir->parent ||
+	    memcmp(file->dir_ent.name, MSDOS_DOTDOT, MSDOS_NAME))
+	    return;
+	first = 2;
+    }
+    cluster = dir->cluster;
+    for (i = first; i < count; i++) {
+	if (i && !(i % per_cluster))
+	    cluster = next_cluster(fs, cluster);
+	file->dir_ent = entries[i];
+	file->offset = cluster_start(fs, cluster) +
+	    i % per_cluster * sizeof(DIR_ENT);
+	if (IS_FREE(file->dir_ent.name)) {
+	    if (slots)
+		return;
+	    continue;
+	}
+	if (file->dir_ent.attr == VFAT_LN_ATTR) {
+	    if (!slots++)
+		lfn_offset = file->offset;
+	    continue;
+	}
+	if (bad_name(file))
+	    return;
+	new = &dir->file[dir->files++];
+	new->dir_ent = file->dir_ent;
+	new->offset = file->offset;
+	new->lfn = NULL;
+	new->lfn_offset = 0;
+	new->start = FSTART(file, fs);
+	new->extents = 0;
+	if (slots) {
+	    if (!(new->lfn = lfn_assemble(&entries[i - slots], slots,
+					  &file->dir_ent)))
+		return;
+	    new->lfn_offset = lfn_offset;
+	    slots = 0;
+	}
+	if (!ahead_chain(fs, dir, new, &max))
+	    return;
+    }
+    if (!slots && !ahead_duplicates(dir))
+	dir->clean = 1;
+}
+
+/**
+ * Take the files of a directory from what a read-ahead thread found out
+ * about it, instead of reading and checking them.
+ *
+ * @param[in]       fs      Information about the filesystem
+ * @param[in]       this    Directory
+ * @param[in]       dir     What the thread found out
+ *
+ * @return  0   Success
+ * @return  1   A directory further up has to be scanned again
+ */
+static int scan_ahead(DOS_FS * fs, DOS_FILE * this, AHEAD_DIR * dir)
+{
+    DOS_FILE **chain, *new, *walk;
+    AHEAD_FILE *file;
+    uint32_t i, *extent;
+
+    chain = &this->first;
+    for (file = dir->file; file < dir->file + dir->files; file++) {
+	new = qalloc(&mem_queue, sizeof(DOS_FILE));
+	new->lfn = NULL;
+	if (file->lfn)
+	    new->lfn = strcpy(qalloc(&mem_queue, strlen(file->lfn) + 1),
+			      file->lfn);
+	new->lfn_offset = file->lfn_offset;
+	new->offset = file->offset;
+	new->dir_ent = file->dir_ent;
+	new->parent = this;
+	link_file(&chain, new);
+    }
+    /* Claim the clusters like check_files() does, up to the first file that
+     * shares some with another one */
+    for (walk = this->first, file = dir->file; walk;
+	 walk = walk->next, file++) {
+	extent = dir->extent + file->extent * 2;
+	for (i = 0; i < file->extents; i++)
+	    if (find_owned(fs, extent[i * 2], extent[i * 2 + 1]) <=
+		extent[i * 2 + 1]) {
+		readahead_stop();
+		return check_files(fs, walk);
+	    }
+	if (file->extents)
+	    add_owner(walk);
+	for (i = 0; i < file->extents; i++)
+	    set_owner_run(fs, extent[i * 2], extent[i * 2 + 1], OWNER_FILE);
+    }
+    return 0;
+}
+
 static int subdirs(DOS_FS * fs, DOS_FILE * parent, FDSC ** cp);
+static int scan_root_dir(DOS_FS * fs);
 
 static int scan_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
 {
     DOS_FILE **chain;
-    int i;
-    uint32_t clu_num;
+    DIR_ENT *entries;
+    AHEAD_DIR *parsed;
+    int i, ahead_count, count, loaded, result;
+    uint32_t clu_num, ahead;
 
     chain = &this->first;
     i = 0;
     clu_num = FSTART(this, fs);
     new_dir();
+    if ((parsed = readahead_get(clu_num))) {
+	/* A directory reached from elsewhere than where the thread took it
+	 * up has other '..' entries to expect */
+	if (parsed->parent == parent_start(fs, this)) {
+	    result = scan_ahead(fs, this, parsed);
+	    readahead_release(parsed);
+	    return result ? result : subdirs(fs, this, cp);
+	}
+	readahead_release(parsed);
+	readahead_stop();
+    }
+    ahead_count = prefetch;
+    ahead = prefetch ? prefetch_chain(fs, clu_num, &ahead_count) : 0;
     if (clu_num != 0 && clu_num != -1 && this->offset) {
 	DOS_FILE file;
+	DIR_ENT dots[2];
 
 	file.lfn = NULL;
 	file.lfn_offset = 0;
@@ -950,26 +1667,53 @@ static int scan_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
 	file.parent = this;
 	file.first = NULL;
 
-	file.offset = cluster_start(fs, clu_num) + (i % fs->cluster_size);
-	fs_read(file.offset, sizeof(DIR_ENT), &file.dir_ent);
-	if (handle_dot(fs, &file, 0))
-	    return 1;
+	/* Fixing '.' does not touch the '..' slot, read both at once */
+	fs_read(cluster_start(fs, clu_num), sizeof(dots), dots);
+	/* A dropped directory has no entries yet, it only gives up its
+	 * clusters */
+	file.offset = cluster_start(fs, clu_num);
+	file.dir_ent = dots[0];
+	if (handle_dot(fs, &file, 0)) {
+	    drop_owner(fs, this);
+	    return 0;
+	}
 	i += sizeof(DIR_ENT);
 
-	file.offset = cluster_start(fs, clu_num) + (i % fs->cluster_size);
-	fs_read(file.offset, sizeof(DIR_ENT), &file.dir_ent);
-	if (handle_dot(fs, &file, 1))
-	    return 1;
+	file.offset = cluster_start(fs, clu_num) + i;
+	file.dir_ent = dots[1];
+	if (handle_dot(fs, &file, 1)) {
+	    drop_owner(fs, this);
+	    return 0;
+	}
 	i += sizeof(DIR_ENT);
     }
+    /* Each cluster is read as a whole when its first entry is due, nothing
+     * writes to the entries after the one being added. The first cluster
+     * is read after the dot entries, which may have been moved into it. */
+    entries = alloc(fs->cluster_size);
+    loaded = 0;
     while (clu_num > 0 && clu_num != -1) {
+	if (!loaded) {
+	    fs_read(cluster_start(fs, clu_num), fs->cluster_size, entries);
+	    loaded = 1;
+	}
 	add_file(fs, &chain, this,
-		 cluster_start(fs, clu_num) + (i % fs->cluster_size), cp);
+		 cluster_start(fs, clu_num) + (i % fs->cluster_size),
+		 &entries[i % fs->cluster_size / sizeof(DIR_ENT)], cp);
 	i += sizeof(DIR_ENT);
-	if (!(i % fs->cluster_size))
+	if (!(i % fs->cluster_size)) {
+	    loaded = 0;
 	    if ((clu_num = next_cluster(fs, clu_num)) == 0 || clu_num == -1)
 		break;
+	    /* Keep reading ahead once half of the clusters are used up */
+	    if (--ahead_count <= prefetch / 2 && ahead) {
+		count = prefetch - ahead_count;
+		ahead = prefetch_chain(fs, ahead, &count);
+		ahead_count += count;
+	    }
+	}
     }
+    free(entries);
     lfn_check_orphaned();
     if (check_dir(fs, &this->first, this->offset))
 	return 0;
@@ -978,6 +1722,36 @@ static int scan_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
     return subdirs(fs, this, cp);
 }
 
+/**
+ * Scan a directory and its subdirectories, again as long as a repair below
+ * asks for it.
+ *
+ * @param[inout]    fs      Information about the filesystem
+ * @param[in]       this    Directory to scan, NULL for the root directory
+ * @param[in]       cp
+ *
+ * @return  0   Success
+ * @return  1   A directory further up has to be scanned again
+ */
+static int scan_tree(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
+{
+    unsigned int mark = owners_count, files = n_files;
+    int rescanning = 0, result;
+
+    while ((result = this ? scan_dir(fs, this, cp) : scan_root_dir(fs)) &&
+	   restart_dir == this) {
+	restart_tree(fs, this, mark);
+	n_files = files;
+	if (!rescanning) {
+	    begin_rescan();
+	    rescanning = 1;
+	}
+    }
+    if (rescanning)
+	end_rescan();
+    return result;
+}
+
 /**
  * Recursively scan subdirectories of the specified parent directory.
  *
@@ -986,49 +1760,106 @@ static int scan_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
  * @param[in]       cp
  *
  * @return  0   Success
- * @return  1   Error
+ * @return  1   A directory further up has to be scanned again
  */
 static int subdirs(DOS_FS * fs, DOS_FILE * parent, FDSC ** cp)
 {
-    DOS_FILE *walk;
+    DOS_FILE *walk, *ahead;
 
+    ahead = parent ? parent->first : root;
+    prefetch_dirs(fs, &ahead, prefetch);
     for (walk = parent ? parent->first : root; walk; walk = walk->next)
-	if (!IS_FREE(walk->dir_ent.name) && (walk->dir_ent.attr & ATTR_DIR))
-	    if (scan_dir(fs, walk, file_cd(cp, (char *)walk->dir_ent.name)))
+	if (!IS_FREE(walk->dir_ent.name) && (walk->dir_ent.attr & ATTR_DIR)) {
+	    prefetch_dirs(fs, &ahead, 1);
+	    if (scan_tree(fs, walk, file_cd(cp, (char *)walk->dir_ent.name)))
 		return 1;
+	}
     return 0;
 }
 
 /**
- * Scan all directory and file information for errors.
+ * Start the read-ahead threads on the subdirectories of the root directory.
+ *
+ * @param[in]       fs      Information about the filesystem
+ */
+static void start_readahead(DOS_FS * fs)
+{
+    DOS_FILE *walk;
+    uint32_t *dirs;
+    int count = 0;
+
+    for (walk = root; walk; walk = walk->next)
+	count++;
+    dirs = alloc((count ? count : 1) * sizeof(uint32_t));
+    count = 0;
+    for (walk = root; walk; walk = walk->next)
+	if (!IS_FREE(walk->dir_ent.name) && (walk->dir_ent.attr & ATTR_DIR))
+	    dirs[count++] = FSTART(walk, fs);
+    readahead_start(fs, jobs - 1, dirs, count, parse_dir);
+    free(dirs);
+}
+
+/**
+ * Scan the root directory and everything below it.
  *
  * @param[inout]    fs      Information about the filesystem
  *
  * @return  0   Success
- * @return  1   Error
+ * @return  1   The root directory has to be scanned again
  */
-int scan_root(DOS_FS * fs)
+static int scan_root_dir(DOS_FS * fs)
 {
     DOS_FILE **chain;
+    DIR_ENT *entries;
     int i;
 
     root = NULL;
+    path_dir_set = 0;
     chain = &root;
     new_dir();
     if (fs->root_cluster) {
-	add_file(fs, &chain, NULL, 0, &fp_root);
+	add_file(fs, &chain, NULL, 0, NULL, &fp_root);
     } else {
+	entries = alloc(fs->root_entries * sizeof(DIR_ENT));
+	fs_read(fs->root_start, fs->root_entries * sizeof(DIR_ENT), entries);
 	for (i = 0; i < fs->root_entries; i++)
 	    add_file(fs, &chain, NULL, fs->root_start + i * sizeof(DIR_ENT),
-		     &fp_root);
+		     &entries[i], &fp_root);
+	free(entries);
     }
     lfn_check_orphaned();
     (void)check_dir(fs, &root, 0);
     if (check_files(fs, root))
 	return 1;
+    /* Nothing in the root directory may change once the threads run */
+    if (!rw && jobs > 1 && !fp_root)
+	start_readahead(fs);
     return subdirs(fs, NULL, &fp_root);
 }
 
+/**
+ * Scan all directory and file information for errors.
+ *
+ * @param[inout]    fs      Information about the filesystem
+ *
+ * @return  0   Success
+ * @return  1   Parts of the tree were scanned again after repairs, the whole
+ *              filesystem should be checked once more
+ */
+int scan_root(DOS_FS * fs)
+{
+    owners_count = 0;
+    restarts = 0;
+    rescan_seconds = 0;
+    (void)scan_tree(fs, NULL, &fp_root);
+    readahead_stop();
+    if (verbose && restarts)
+	printf("Scanned parts of the directory tree again %u time%s after "
+	       "repairs, taking %.3f seconds.\n", restarts,
+	       restarts == 1 ? "" : "s", rescan_seconds);
+    return restarts != 0;
+}
+
 static char print_fat_dirty_state(void)
 {
     printf("Dirty bit is set. Fs was not properly unmounted and"
@@ -1055,13 +1886,8 @@ void check_dirty_bits(DOS_FS * fs)
 		    b32.boot_flags &= ~FAT_STATE_DIRTY;
 		    fs_write(0, sizeof(b32), &b32);
 		}
-		if (!(fat32_flags.value & FAT32_FLAG_CLEAN_SHUTDOWN)) {
-		    uint32_t *new_flags_ptr = (uint32_t *)(fs->fat + 4);
-		    *new_flags_ptr = htole32(fat32_flags.value | FAT32_FLAG_CLEAN_SHUTDOWN | (fat32_flags.reserved << 28));
-		    fs_write(fs->fat_start + 4, 4, new_flags_ptr);
-		    if (fs->nfats > 1)
-			fs_write(fs->fat_start + 4 + fs->fat_size, 4, new_flags_ptr);
-		}
+		if (!(fat32_flags.value & FAT32_FLAG_CLEAN_SHUTDOWN))
+		    set_fat_entry(fs, 1, fat32_flags.value | FAT32_FLAG_CLEAN_SHUTDOWN | (fat32_flags.reserved << 28));
 	    }
 	}
     } else {
@@ -1082,13 +1908,8 @@ void check_dirty_bits(DOS_FS * fs)
 		    b16.boot_flags &= ~FAT_STATE_DIRTY;
 		    fs_write(0, sizeof(b16), &b16);
 		}
-		if (fat16_is_dirty) {
-		    uint16_t *new_flags_ptr = (uint16_t *)(fs->fat + 2);
-		    *new_flags_ptr = htole16(fat16_flags.value | FAT16_FLAG_CLEAN_SHUTDOWN);
-		    fs_write(fs->fat_start + 2, 2, new_flags_ptr);
-		    if (fs->nfats > 1)
-			fs_write(fs->fat_start + 2 + fs->fat_size, 2, new_flags_ptr);
-		}
+		if (fat16_is_dirty)
+		    set_fat_entry(fs, 1, fat16_flags.value | FAT16_FLAG_CLEAN_SHUTDOWN);
 	    }
 	}
     }
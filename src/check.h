@@ -23,6 +23,9 @@
 #ifndef _CHECK_H
 #define _CHECK_H
 
+/* Upper limit for the number of directory clusters read ahead */
+#define PREFETCH_MAX 256
+
 void check_dirty_bits(DOS_FS * fs);
 
 int scan_root(DOS_FS * fs);
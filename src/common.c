@@ -46,10 +46,25 @@ int atari_format;
 const char *program_name;
 
 
-typedef struct _link {
-    void *data;
-    struct _link *next;
-} LINK;
+/*
+ * The data areas of a queue are carved out of large chunks, which are only
+ * returned to the system as a whole. A queue is a list of chunks plus a
+ * pointer to the chunk currently being filled, so it can be emptied without
+ * touching the chunks and then refilled from the start.
+ */
+#define QUEUE_CHUNK (64 * 1024)
+
+typedef union _chunk {
+    struct {
+	union _chunk *next;
+	size_t size, used;
+    } hdr;
+    long double align;		/* keeps the data after the header aligned */
+} CHUNK;
+
+typedef struct {
+    CHUNK *first, *current;
+} QUEUE;
 
 void die(const char *msg, ...)
 {
@@ -91,24 +106,61 @@ void *alloc(int size)
 
 void *qalloc(void **root, int size)
 {
-    LINK *link;
+    QUEUE *queue = *root;
+    CHUNK *chunk, *new;
+    size_t need;
+
+    need = (size + sizeof(CHUNK) - 1) / sizeof(CHUNK) * sizeof(CHUNK);
+    if (!queue) {
+	queue = *root = alloc(sizeof(QUEUE));
+	queue->first = queue->current = NULL;
+    }
+    chunk = queue->current;
+    /* Chunks after the current one are left over from before a qreset */
+    while (chunk && chunk->hdr.used + need > chunk->hdr.size &&
+	   chunk->hdr.next) {
+	chunk = chunk->hdr.next;
+	chunk->hdr.used = 0;
+    }
+    if (!chunk || chunk->hdr.used + need > chunk->hdr.size) {
+	new = alloc(sizeof(CHUNK) + (need > QUEUE_CHUNK ? need : QUEUE_CHUNK));
+	new->hdr.next = NULL;
+	new->hdr.size = need > QUEUE_CHUNK ? need : QUEUE_CHUNK;
+	new->hdr.used = 0;
+	if (chunk)
+	    chunk->hdr.next = new;
+	else
+	    queue->first = new;
+	chunk = new;
+    }
+    queue->current = chunk;
+    chunk->hdr.used += need;
+    return (char *)(chunk + 1) + chunk->hdr.used - need;
+}
+
+void qreset(void **root)
+{
+    QUEUE *queue = *root;
 
-    link = alloc(sizeof(LINK));
-    link->next = *root;
-    *root = link;
-    return link->data = alloc(size);
+    if (queue && queue->first) {
+	queue->current = queue->first;
+	queue->first->hdr.used = 0;
+    }
 }
 
 void qfree(void **root)
 {
-    LINK *this;
+    QUEUE *queue = *root;
+    CHUNK *this;
 
-    while (*root) {
-	this = (LINK *) * root;
-	*root = this->next;
-	free(this->data);
+    if (!queue)
+	return;
+    while ((this = queue->first)) {
+	queue->first = this->hdr.next;
 	free(this);
     }
+    free(queue);
+    *root = NULL;
 }
 
 int min(int a, int b)
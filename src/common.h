@@ -57,7 +57,14 @@ void *alloc(int size);
 
 void *qalloc(void **root, int size);
 
-/* Like alloc, but registers the data area in a list described by ROOT. */
+/* Like alloc, but takes the data area from the queue described by ROOT, which
+   hands out memory from large chunks. The data area can not be freed on its
+   own. */
+
+void qreset(void **root);
+
+/* Discards all qalloc'ed data areas described by ROOT at once, but keeps their
+   memory for the next qalloc calls on ROOT. */
 
 void qfree(void **root);
 
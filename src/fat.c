@@ -36,54 +36,534 @@
 #include "boot.h"
 #include "check.h"
 #include "fat.h"
+#include "fat_bitmap.h"
+
+/* Number of clusters fix_bad() tests at once */
+#define TEST_BATCH 64
+
+/* Number of bytes of a second FAT copy compare_fat() reads at once */
+#define COMPARE_CHUNK (1024 * 1024)
+
+/* Returns the ownership of CLUSTER in the 2 bit per cluster map OWNER. */
+static inline int owner_of(const uint32_t *owner, uint32_t cluster)
+{
+    return owner[cluster / 16] >> (cluster % 16 * 2) & 3;
+}
+
+/* Returns the first cluster from FROM up to TO that links to cluster 1 or
+ * past the end of the filesystem, or TO if there is none. */
+static uint32_t find_invalid(DOS_FS * fs, uint32_t from, uint32_t to)
+{
+    const uint32_t *fat = fs->fat;
+    uint32_t mask = fs->fat_bits == 32 ? 0xfffffff : 0xffffffff;
+    uint32_t first = fs->data_clusters + 2, range = FAT_MIN_BAD(fs) - first;
+    uint32_t i, value;
+
+    for (i = from; i < to; i++) {
+	value = fat[i] & mask;
+	if (value == 1 || value - first < range)
+	    break;
+    }
+    return i;
+}
+
+/*
+ * Bitmaps of the free and of the bad clusters, one bit per cluster. read_fat()
+ * builds them in one sweep over the decoded FAT and set_fat() keeps them up to
+ * date. Combined with the ownership table they tell the used, the unused and
+ * the orphaned clusters apart 32 at a time. Entries 0 and 1 and the padding
+ * of the last word count as bad, so they are neither used nor unused.
+ *
+ * The run map, built and kept up to date the same way, has the bits of the
+ * clusters that link to the cluster right after them. The runs of set bits
+ * are the extents of the cluster chains, which chain_run() looks up 32
+ * clusters at a time.
+ */
+static uint32_t *free_map, *bad_map, *run_map;
+
+/*
+ * Bitmap of the clusters that are on a cycle of cluster chains, one bit per
+ * cluster. scan_graph() finds them when read_fat() repairs the filesystem,
+ * before the directory tree is walked. Repairs only ever cut chains, so a
+ * cluster on a cycle found later is always in it.
+ */
+static uint32_t *cycle_map;
+
+/*
+ * Summary levels over the free bitmap, level 0 being free_map itself: bit J
+ * of word I of level K + 1 is set if word I * 32 + J of level K has any bit
+ * set. The top level is a single word, so next_free() gets from anywhere to
+ * the next free cluster in a step or two per level. update_bitmap() keeps
+ * the levels in step as set_fat() frees and claims clusters.
+ */
+#define FREE_LEVELS 7		/* 32^7 bits are more than any FAT has */
+static uint32_t *free_level[FREE_LEVELS], free_words[FREE_LEVELS];
+static int free_levels;
+
+/* Kinds of clusters find_cluster() looks for */
+#define FIND_USED	0	/* allocated, but neither owned nor bad */
+#define FIND_UNUSED	1	/* neither owned nor bad */
+
+/* Returns a bit for each of the 16 clusters of word OWNER of the ownership
+ * table, set if the cluster is owned. */
+static inline uint32_t owned_half(uint32_t owner)
+{
+    /* Fold every 2 bit field onto its low bit, then close the gaps */
+    uint32_t bits = (owner | owner >> 1) & 0x55555555;
+
+    bits = (bits | bits >> 1) & 0x33333333;
+    bits = (bits | bits >> 2) & 0x0f0f0f0f;
+    bits = (bits | bits >> 4) & 0x00ff00ff;
+    return (bits | bits >> 8) & 0x0000ffff;
+}
+
+/* Returns the clusters of bitmap word WORD that are of kind KIND. */
+static inline uint32_t map_bits(DOS_FS * fs, uint32_t word, int kind)
+{
+    const uint32_t *owner = &fs->cluster_owner[word * 2];
+    uint32_t bits = ~(bad_map[word] | owned_half(owner[0]) |
+		      owned_half(owner[1]) << 16);
+
+    return kind == FIND_USED ? bits & ~free_map[word] : bits;
+}
+
+/* Returns the first cluster from FROM on that is of kind KIND, or
+ * fs->data_clusters + 2 if there is none. */
+static uint32_t find_cluster(DOS_FS * fs, uint32_t from, int kind)
+{
+    uint32_t to = fs->data_clusters + 2, word = from / 32, bits;
+
+    if (from >= to)
+	return to;
+    bits = map_bits(fs, word, kind) & ~0U << from % 32;
+    while (!bits) {
+	if (++word * 32 >= to)
+	    return to;
+	bits = map_bits(fs, word, kind);
+    }
+    from = word * 32 + __builtin_ctz(bits);
+    return from < to ? from : to;
+}
+
+/* Returns the number of clusters that are neither owned nor bad. */
+static uint32_t count_unused(DOS_FS * fs)
+{
+    uint32_t word, words = (fs->data_clusters + 2 + 31) / 32, count = 0;
+
+    for (word = 0; word < words; word++)
+	count += __builtin_popcount(map_bits(fs, word, FIND_UNUSED));
+    return count;
+}
+
+/* Builds the summary levels over the WORDS words of free_map. */
+static void build_free_levels(uint32_t words)
+{
+    uint32_t i;
+    int k;
+
+    free_level[0] = free_map;
+    free_words[0] = words;
+    for (k = 1; free_words[k - 1] > 1; k++) {
+	free_words[k] = (free_words[k - 1] + 31) / 32;
+	free_level[k] = alloc(free_words[k] * sizeof(uint32_t));
+	memset(free_level[k], 0, free_words[k] * sizeof(uint32_t));
+	for (i = 0; i < free_words[k - 1]; i++)
+	    if (free_level[k - 1][i])
+		free_level[k][i / 32] |= 1U << i % 32;
+    }
+    free_levels = k;
+}
+
+/* Passes on to the summary levels that word INDEX of free_map has become
+ * non-zero (SET) or zero. */
+static void update_free_levels(uint32_t index, int set)
+{
+    uint32_t *word, old;
+    int k;
+
+    for (k = 1; k < free_levels; k++, index /= 32) {
+	word = &free_level[k][index / 32];
+	old = *word;
+	*word = set ? old | 1U << index % 32 : old & ~(1U << index % 32);
+	if (!old == !*word)
+	    break;
+    }
+}
+
+/* Brings the bitmaps up to date with the FAT entry of CLUSTER. */
+static void update_bitmap(DOS_FS * fs, uint32_t cluster)
+{
+    uint32_t value, old, bit = 1U << cluster % 32;
+    uint32_t *free_word = &free_map[cluster / 32];
+    uint32_t *bad_word = &bad_map[cluster / 32];
+    uint32_t *run_word = &run_map[cluster / 32];
+
+    if (cluster < 2)
+	return;
+    value = fs->fat[cluster];
+    if (fs->fat_bits == 32)
+	value &= 0xfffffff;
+    old = *free_word;
+    *free_word = value ? old & ~bit : old | bit;
+    if (!old != !*free_word)
+	update_free_levels(cluster / 32, *free_word != 0);
+    *bad_word = FAT_IS_BAD(fs, value) ? *bad_word | bit : *bad_word & ~bit;
+    *run_word = value == cluster + 1 ? *run_word | bit : *run_word & ~bit;
+}
+
+/* Returns the first free cluster from FROM on, or fs->data_clusters + 2 if
+ * there is none. */
+static uint32_t next_free(DOS_FS * fs, uint32_t from)
+{
+    uint32_t total = fs->data_clusters + 2, pos = from, bits = 0;
+    int k;
+
+    if (from >= total)
+	return total;
+    /* Up the levels until a word has a bit at or after the position... */
+    for (k = 0;; k++, pos = pos / 32 + 1) {
+	if (pos / 32 < free_words[k] &&
+	    (bits = free_level[k][pos / 32] & ~0U << pos % 32))
+	    break;
+	if (k == free_levels - 1)
+	    return total;
+    }
+    /* ...and down again along the first set bits */
+    pos = pos / 32 * 32 + __builtin_ctz(bits);
+    while (k--)
+	pos = pos * 32 + __builtin_ctz(free_level[k][pos]);
+    return pos < total ? pos : total;
+}
+
+/* Returns the first cluster from FIRST up to LAST whose bit is set in MAP,
+ * or LAST + 1 if there is none. */
+static uint32_t first_in_map(const uint32_t *map, uint32_t first,
+			     uint32_t last)
+{
+    uint32_t word = first / 32, bits = map[word] & ~0U << first % 32;
+
+    while (!bits) {
+	if (++word > last / 32)
+	    return last + 1;
+	bits = map[word];
+    }
+    first = word * 32 + __builtin_ctz(bits);
+    return first <= last ? first : last + 1;
+}
+
+/*
+ * The FAT is kept in memory decoded into one native uint32_t per cluster, so
+ * lookups are plain loads. FAT32 entries keep their reserved high bits.
+ * set_fat() only changes the decoded table and marks the sectors of the FAT
+ * that hold the entry in a dirty bitmap. fat_flush() encodes the runs of
+ * dirty sectors back into the on-disk format and queues each run once for
+ * every FAT copy, when the FAT is released, or with -w whenever
+ * flush_interval sectors are dirty.
+ */
+static uint32_t *dirty_map;
+static uint32_t dirty_sectors;
+
+/* A range of clusters or bytes, both ends included */
+typedef struct {
+    uint32_t first, last;
+} FAT_RANGE;
+
+/**
+ * Fetch an entry from a FAT copy in on-disk format.
+ *
+ * @param[in]	raw	    FAT copy as stored on disk
+ * @param[in]	cluster     Cluster of interest
+ * @param[in]	fs          Information from the FAT boot sectors (bits per FAT entry)
+ *
+ * @return  The entry, including the reserved bits of FAT32 entries
+ */
+static uint32_t get_raw_fat(const unsigned char *raw, uint32_t cluster,
+			    DOS_FS * fs)
+{
+    const unsigned char *ptr;
+
+    switch (fs->fat_bits) {
+    case 12:
+	ptr = &raw[cluster * 3 / 2];
+	return 0xfff & (cluster & 1 ? (ptr[0] >> 4) | (ptr[1] << 4) :
+			(ptr[0] | ptr[1] << 8));
+    case 16:
+	return le16toh(((const uint16_t *)raw)[cluster]);
+    case 32:
+	return le32toh(((const uint32_t *)raw)[cluster]);
+    default:
+	die("Bad FAT entry size: %d bits.", fs->fat_bits);
+    }
+}
 
 /**
  * Fetch the FAT entry for a specified cluster.
  *
  * @param[out]  entry	    Cluster to which cluster of interest is linked
- * @param[in]	fat	    FAT table for the partition
+ * @param[in]	fat	    Decoded FAT table for the partition (fs->fat)
  * @param[in]	cluster     Cluster of interest
  * @param[in]	fs          Information from the FAT boot sectors (bits per FAT entry)
  */
 void get_fat(FAT_ENTRY * entry, void *fat, uint32_t cluster, DOS_FS * fs)
 {
-    unsigned char *ptr;
+    uint32_t e;
 
     if (cluster > fs->data_clusters + 1) {
 	die("Internal error: cluster out of range in get_fat() (%lu > %lu).",
 		(unsigned long)cluster, (unsigned long)(fs->data_clusters + 1));
     }
 
+    e = ((uint32_t *)fat)[cluster];
+    /* According to M$, the high 4 bits of a FAT32 entry are reserved and
+     * are not part of the cluster number. So we cut them off. */
+    entry->value = fs->fat_bits == 32 ? e & 0xfffffff : e;
+    entry->reserved = fs->fat_bits == 32 ? e >> 28 : 0;
+}
+
+/**
+ * Load a copy of the FAT. On filesystems opened read-only, the FAT is mapped
+ * in place instead of being copied into allocated memory.
+ *
+ * @param[in]   pos         Byte offset of the FAT copy
+ * @param[in]   eff_size    Number of bytes used by FAT entries
+ * @param[in]   alloc_size  Number of bytes to provide
+ * @param[out]  mapped      Set to alloc_size if the copy is mapped, 0 otherwise
+ *
+ * @return  Pointer to the FAT copy
+ */
+static void *load_fat(off_t pos, int eff_size, int alloc_size,
+		      unsigned int *mapped)
+{
+    void *fat;
+
+    if ((fat = fs_map(pos, alloc_size))) {
+	*mapped = alloc_size;
+	return fat;
+    }
+    fat = alloc(alloc_size);
+    fs_read(pos, eff_size, fat);
+    *mapped = 0;
+    return fat;
+}
+
+static void unload_fat(void *fat, unsigned int mapped)
+{
+    if (mapped)
+	fs_unmap(fat, mapped);
+    else
+	free(fat);
+}
+
+/**
+ * Decode a FAT copy loaded by load_fat into the in-memory representation.
+ * FAT32 copies are decoded in place, others into newly allocated memory.
+ *
+ * @param[in]	    fs      Information about the filesystem
+ * @param[in]	    raw     FAT copy in on-disk format
+ * @param[in,out]   mapped  Mapping size of RAW, updated for the result
+ *
+ * @return  The decoded FAT
+ */
+static uint32_t *decode_fat(DOS_FS * fs, unsigned char *raw,
+			    unsigned int *mapped)
+{
+    uint32_t total = fs->data_clusters + 2;
+    uint32_t i, *fat;
+    unsigned char *ptr;
+
+    if (fs->fat_bits == 32) {
+	fat = (uint32_t *)raw;
+	if (htole32(1) != 1)
+	    for (i = 0; i < total; i++)
+		fat[i] = le32toh(fat[i]);
+	return fat;
+    }
+
+    /* Room for an even number of entries, like the FAT12 copy itself */
+    fat = alloc((total + 1) / 2 * 2 * sizeof(uint32_t));
+    if (fs->fat_bits == 12) {
+	for (i = 0; i < total; i += 2) {
+	    ptr = raw + i * 3 / 2;
+	    fat[i] = ptr[0] | (ptr[1] & 0xf) << 8;
+	    fat[i + 1] = ptr[1] >> 4 | ptr[2] << 4;
+	}
+	/* Keep the padding entry zero, it is encoded along with the last one */
+	if (total & 1)
+	    fat[total] = 0;
+    } else {
+	for (i = 0; i < total; i++)
+	    fat[i] = le16toh(((uint16_t *)raw)[i]);
+    }
+    unload_fat(raw, *mapped);
+    *mapped = 0;
+    return fat;
+}
+
+/* Returns the byte offset of FAT copy COPY, counting from 0. */
+static off_t fat_copy_start(DOS_FS * fs, int copy)
+{
+    return fs->fat_start + (off_t)copy * fs->fat_size;
+}
+
+/* Returns the number of bytes used by entries in each FAT copy. */
+static off_t fat_bytes(DOS_FS * fs)
+{
+    return ((off_t)(fs->data_clusters + 2) * fs->fat_bits + 7) / 8;
+}
+
+/**
+ * Encode the sectors FIRST to LAST of the decoded FAT into on-disk format and
+ * queue them for writing to the FAT copies. The bytes past the last entry
+ * are left alone.
+ *
+ * @param[in]	fs	Information about the filesystem
+ * @param[in]	first	First sector of the FAT to write
+ * @param[in]	last	Last sector of the FAT to write
+ */
+static void write_fat_sectors(DOS_FS * fs, uint32_t first, uint32_t last)
+{
+    const uint32_t *fat = fs->fat;
+    unsigned char *buf;
+    off_t start, end, pos;
+    uint32_t i;
+    uint16_t le16;
+    uint32_t le32;
+    int copy;
+
+    start = (off_t)first * fs->sector_size;
+    end = (off_t)(last + 1) * fs->sector_size;
+    if (end > fat_bytes(fs))
+	end = fat_bytes(fs);
+    buf = alloc(end - start);
     switch (fs->fat_bits) {
     case 12:
-	ptr = &((unsigned char *)fat)[cluster * 3 / 2];
-	entry->value = 0xfff & (cluster & 1 ? (ptr[0] >> 4) | (ptr[1] << 4) :
-				(ptr[0] | ptr[1] << 8));
+	/* Entries 2n and 2n + 1 share the 3 bytes from 3n on, which may
+	 * straddle a sector boundary */
+	for (pos = start; pos < end; pos++) {
+	    i = pos / 3 * 2;
+	    switch (pos % 3) {
+	    case 0:
+		buf[pos - start] = fat[i] & 0xff;
+		break;
+	    case 1:
+		buf[pos - start] = fat[i] >> 8 | (fat[i + 1] & 0xf) << 4;
+		break;
+	    default:
+		buf[pos - start] = fat[i + 1] >> 4;
+	    }
+	}
 	break;
     case 16:
-	entry->value = le16toh(((unsigned short *)fat)[cluster]);
-	break;
-    case 32:
-	/* According to M$, the high 4 bits of a FAT32 entry are reserved and
-	 * are not part of the cluster number. So we cut them off. */
-	{
-	    uint32_t e = le32toh(((unsigned int *)fat)[cluster]);
-	    entry->value = e & 0xfffffff;
-	    entry->reserved = e >> 28;
+	for (pos = start; pos < end; pos += 2) {
+	    le16 = htole16(fat[pos / 2]);
+	    memcpy(buf + (pos - start), &le16, 2);
 	}
 	break;
     default:
-	die("Bad FAT entry size: %d bits.", fs->fat_bits);
+	for (pos = start; pos < end; pos += 4) {
+	    le32 = htole32(fat[pos / 4]);
+	    memcpy(buf + (pos - start), &le32, 4);
+	}
+    }
+    for (copy = 0; copy < fs->nfats; copy++)
+	fs_write(fat_copy_start(fs, copy) + start, end - start, buf);
+    free(buf);
+}
+
+/* Append the range FIRST to LAST to the array RANGES of COUNT ranges, which
+ * has room for MAX. */
+static void add_range(FAT_RANGE ** ranges, int *count, int *max,
+		      uint32_t first, uint32_t last)
+{
+    FAT_RANGE *grown;
+
+    if (*count == *max) {
+	*max = *max ? *max * 2 : 64;
+	grown = alloc(*max * sizeof(FAT_RANGE));
+	if (*count)
+	    memcpy(grown, *ranges, *count * sizeof(FAT_RANGE));
+	free(*ranges);
+	*ranges = grown;
+    }
+    (*ranges)[*count].first = first;
+    (*ranges)[*count].last = last;
+    (*count)++;
+}
+
+/* Write out the runs of dirty sectors of the FAT. */
+static void fat_flush(DOS_FS * fs)
+{
+    uint32_t sectors, sector, word, bits, first;
+
+    if (!dirty_sectors)
+	return;
+    sectors = (fat_bytes(fs) + fs->sector_size - 1) / fs->sector_size;
+    for (sector = 0; sector < sectors;) {
+	word = dirty_map[sector / 32] >> sector % 32;
+	if (!word) {
+	    sector += 32 - sector % 32;
+	    continue;
+	}
+	sector += __builtin_ctz(word);
+	first = sector;
+	/* Extend the run over the following dirty sectors */
+	while (sector < sectors &&
+	       (bits = dirty_map[sector / 32] >> sector % 32) & 1)
+	    sector += bits == ~0U >> sector % 32 ? 32 - sector % 32 :
+		__builtin_ctz(~bits);
+	write_fat_sectors(fs, first, sector - 1);
     }
+    memset(dirty_map, 0, (sectors + 31) / 32 * sizeof(uint32_t));
+    dirty_sectors = 0;
+}
+
+/* Mark the sector of the FAT that holds byte POS of the entries as dirty. */
+static void mark_sector(DOS_FS * fs, off_t pos)
+{
+    uint32_t sector = pos / fs->sector_size;
+    uint32_t bit = 1U << sector % 32;
+
+    if (!(dirty_map[sector / 32] & bit)) {
+	dirty_map[sector / 32] |= bit;
+	dirty_sectors++;
+    }
+}
+
+/* Remember that the entry of CLUSTER has changed. */
+static void mark_dirty(DOS_FS * fs, uint32_t cluster)
+{
+    off_t pos = (off_t)cluster * fs->fat_bits / 8;
+
+    mark_sector(fs, pos);
+    /* FAT12 entries may straddle two sectors */
+    if (fs->fat_bits == 12)
+	mark_sector(fs, pos + 1);
+    if (write_immed && dirty_sectors >= flush_interval)
+	fat_flush(fs);
 }
 
 void release_fat(DOS_FS * fs)
 {
-    if (fs->fat)
-	free(fs->fat);
+    if (fs->fat) {
+	fat_flush(fs);
+	unload_fat(fs->fat, fs->fat_map_size);
+    }
     if (fs->cluster_owner)
 	free(fs->cluster_owner);
+    free(free_map);
+    free(bad_map);
+    free(run_map);
+    free_map = bad_map = run_map = NULL;
+    while (free_levels > 1)
+	free(free_level[--free_levels]);
+    free_levels = 0;
+    free(cycle_map);
+    cycle_map = NULL;
+    free(dirty_map);
+    dirty_map = NULL;
+    dirty_sectors = 0;
     fs->fat = NULL;
+    fs->fat_map_size = 0;
     fs->cluster_owner = NULL;
 }
 
@@ -102,10 +582,347 @@ static void fix_first_cluster(DOS_FS * fs, void * first_cluster)
         *(uint32_t *)first_cluster = htole32(FAT_EXTD(fs) | b.media);
 }
 
+/**
+ * Compare the FAT copy on disk at POS with the one in memory. The copy on disk
+ * is read a chunk at a time, so it is never held in memory as a whole.
+ *
+ * @param[in]	pos	    Byte offset of the FAT copy on disk
+ * @param[in]	fat	    FAT copy in memory, in on-disk format
+ * @param[in]	eff_size    Number of bytes used by FAT entries
+ * @param[out]	count	    Number of differing ranges
+ *
+ * @return  The ranges of bytes that differ, in whole sectors, or NULL if the
+ *	    copies are the same
+ */
+static FAT_RANGE *compare_fat(off_t pos, const unsigned char *fat,
+			      int eff_size, int *count)
+{
+    FAT_RANGE *ranges = NULL;
+    unsigned char *chunk = alloc(COMPARE_CHUNK);
+    int max = 0, offset, size, sector, length;
+
+    *count = 0;
+    for (offset = 0; offset < eff_size; offset += size) {
+	size = eff_size - offset < COMPARE_CHUNK ? eff_size - offset :
+	    COMPARE_CHUNK;
+	fs_read(pos + offset, size, chunk);
+	for (sector = 0; sector < size; sector += SECTOR_SIZE) {
+	    length = size - sector < SECTOR_SIZE ? size - sector : SECTOR_SIZE;
+	    if (!memcmp(chunk + sector, fat + offset + sector, length))
+		continue;
+	    if (*count && ranges[*count - 1].last + 1 == offset + sector)
+		ranges[*count - 1].last += length;
+	    else
+		add_range(&ranges, count, &max, offset + sector,
+			  offset + sector + length - 1);
+	}
+    }
+    free(chunk);
+    return ranges;
+}
+
+/* Write the RANGES of bytes of FAT to the FAT copy on disk at POS. */
+static void write_ranges(off_t pos, unsigned char *fat,
+			 const FAT_RANGE * ranges, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+	fs_write(pos + ranges[i].first, ranges[i].last - ranges[i].first + 1,
+		 fat + ranges[i].first);
+}
+
+/* Read the RANGES of bytes of the FAT copy on disk at POS into FAT. */
+static void read_ranges(off_t pos, unsigned char *fat,
+			const FAT_RANGE * ranges, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+	fs_read(pos + ranges[i].first, ranges[i].last - ranges[i].first + 1,
+		fat + ranges[i].first);
+}
+
+/* Fix the first entry of FAT and write it to all FAT copies. */
+static void fix_media(DOS_FS * fs, unsigned char *fat)
+{
+    int copy;
+
+    fix_first_cluster(fs, fat);
+    for (copy = 0; copy < fs->nfats; copy++)
+	fs_write(fat_copy_start(fs, copy), (fs->fat_bits + 7) / 8, fat);
+}
+
+/* Return whether the first entry of FAT copy COPY holds the media byte with
+ * all other bits set. */
+static int media_ok(DOS_FS * fs, int copy)
+{
+    unsigned char head[4];
+
+    fs_read(fat_copy_start(fs, copy), sizeof(head), head);
+    return (get_raw_fat(head, 0, fs) & FAT_EXTD(fs)) == FAT_EXTD(fs);
+}
+
+/**
+ * Reconcile three or more FAT copies by a majority vote over each sector. All
+ * copies are streamed through chunk buffers together, so none of them but the
+ * one in memory is held as a whole. The sector content shared by most copies
+ * wins, ties going to the lowest numbered copy. The first sector is only
+ * taken from copies with a valid first entry. Only the sectors in which a
+ * copy differs from the winner are rewritten.
+ *
+ * @param[in]	    fs	        Information about the filesystem
+ * @param[in,out]   fat         FAT copy 0 in on-disk format, replaced by
+ *				the winning sectors
+ * @param[in]	    eff_size    Number of bytes used by FAT entries
+ * @param[in]	    ok	        For each copy, whether its first entry is valid
+ * @param[in]	    mode        1 - die if the copies differ, 2 - repair
+ */
+static void vote_fat(DOS_FS * fs, unsigned char *fat, int eff_size,
+		     const int *ok, int mode)
+{
+    int copies = fs->nfats, copy, other, votes, most, winner, differ = 0;
+    int offset, size, sector, length;
+    unsigned char **chunk = alloc(copies * sizeof(unsigned char *));
+    FAT_RANGE **ranges = alloc(copies * sizeof(FAT_RANGE *));
+    int *count = alloc(copies * sizeof(int));
+    int *max = alloc(copies * sizeof(int));
+
+    for (copy = 0; copy < copies; copy++) {
+	chunk[copy] = copy ? alloc(COMPARE_CHUNK) : NULL;
+	ranges[copy] = NULL;
+	count[copy] = max[copy] = 0;
+    }
+    for (offset = 0; offset < eff_size; offset += size) {
+	size = eff_size - offset < COMPARE_CHUNK ? eff_size - offset :
+	    COMPARE_CHUNK;
+	chunk[0] = fat + offset;
+	for (copy = 1; copy < copies; copy++)
+	    fs_read(fat_copy_start(fs, copy) + offset, size, chunk[copy]);
+	for (sector = 0; sector < size; sector += SECTOR_SIZE) {
+	    length = size - sector < SECTOR_SIZE ? size - sector : SECTOR_SIZE;
+	    for (copy = 1; copy < copies &&
+		 !memcmp(chunk[0] + sector, chunk[copy] + sector, length);
+		 copy++) ;
+	    if (copy == copies)
+		continue;
+
+	    winner = -1;
+	    most = 0;
+	    for (copy = 0; copy < copies; copy++) {
+		if (offset + sector == 0 && !ok[copy])
+		    continue;
+		for (other = votes = 0; other < copies; other++)
+		    votes += !memcmp(chunk[copy] + sector,
+				     chunk[other] + sector, length);
+		if (votes > most) {
+		    most = votes;
+		    winner = copy;
+		}
+	    }
+	    for (copy = 0; copy < copies; copy++) {
+		if (copy == winner || !memcmp(chunk[copy] + sector,
+					      chunk[winner] + sector, length))
+		    continue;
+		differ = 1;
+		if (count[copy] &&
+		    ranges[copy][count[copy] - 1].last + 1 == offset + sector)
+		    ranges[copy][count[copy] - 1].last += length;
+		else
+		    add_range(&ranges[copy], &count[copy], &max[copy],
+			      offset + sector, offset + sector + length - 1);
+	    }
+	    if (winner)
+		memcpy(chunk[0] + sector, chunk[winner] + sector, length);
+	}
+    }
+
+    if (differ) {
+	if (mode != 2)
+	    die("FATs differ, please run fsck.fat");
+	printf("FATs differ - using the majority of %d FATs.\n", copies);
+	for (copy = 0; copy < copies; copy++)
+	    write_ranges(fat_copy_start(fs, copy), fat, ranges[copy],
+			 count[copy]);
+    }
+    for (copy = 0; copy < copies; copy++) {
+	if (copy)
+	    free(chunk[copy]);
+	free(ranges[copy]);
+    }
+    free(chunk);
+    free(ranges);
+    free(count);
+    free(max);
+}
+
+/* Returns the cluster CLUSTER links to, or 0 if its entry is not a link to
+ * an allocated cluster. */
+static inline uint32_t link_of(DOS_FS * fs, uint32_t cluster)
+{
+    uint32_t value = fs->fat[cluster];
+
+    if (fs->fat_bits == 32)
+	value &= 0xfffffff;
+    if (value < 2 || value >= fs->data_clusters + 2 ||
+	(free_map[value / 32] | bad_map[value / 32]) >> value % 32 & 1)
+	return 0;
+    return value;
+}
+
+/* Marks the clusters of the cycle through START in cycle_map and SEEN. The
+ * map is only allocated once there is a cycle. */
+static void mark_cycle(DOS_FS * fs, uint32_t start, uint32_t * seen)
+{
+    uint32_t walk = start, words = (fs->data_clusters + 2 + 31) / 32;
+
+    if (!cycle_map) {
+	cycle_map = alloc(words * sizeof(uint32_t));
+	memset(cycle_map, 0, words * sizeof(uint32_t));
+    }
+    do {
+	seen[walk / 32] |= 1U << walk % 32;
+	cycle_map[walk / 32] |= 1U << walk % 32;
+	walk = link_of(fs, walk);
+    } while (walk != start);
+}
+
+/**
+ * Analyse the cluster chains of the whole FAT before the directory tree is
+ * walked. Every cluster links to at most one other, so the chains form a
+ * graph of trees that end in an end-of-chain mark or in a cycle. This counts
+ * the heads (allocated clusters nothing links to) and the merge points
+ * (clusters linked to more than once) and records the clusters on cycles in
+ * cycle_map.
+ *
+ * The chains are followed from every head, each cluster only once. A walk
+ * that runs into a cluster seen before has either merged into an earlier
+ * chain or looped back into itself, and a second walk over the clusters just
+ * visited tells which. What no head reaches can only be pure cycles.
+ *
+ * @param[in]	    fs      Information about the filesystem
+ */
+static void scan_graph(DOS_FS * fs)
+{
+    uint32_t total_num_clusters = fs->data_clusters + 2;
+    uint32_t words = (total_num_clusters + 31) / 32;
+    uint32_t *linked = alloc(words * sizeof(uint32_t));
+    uint32_t *seen = alloc(words * sizeof(uint32_t));
+    uint32_t w, bits, i, walk, next, last, heads = 0, merges = 0, cycles = 0;
+    uint32_t used = 0, reached = 0;
+
+    memset(linked, 0, words * sizeof(uint32_t));
+    memset(seen, 0, words * sizeof(uint32_t));
+
+    /* Nothing is owned yet, so the allocated clusters are the ones neither
+     * free nor bad. In-degrees first, SEEN marking the merge points for now */
+    for (w = 0; w < words; w++)
+	for (bits = ~(free_map[w] | bad_map[w]); bits; bits &= bits - 1) {
+	    i = w * 32 + __builtin_ctz(bits);
+	    used++;
+	    if (!(next = link_of(fs, i)))
+		continue;
+	    if (!(linked[next / 32] >> next % 32 & 1))
+		linked[next / 32] |= 1U << next % 32;
+	    else if (!(seen[next / 32] >> next % 32 & 1)) {
+		seen[next / 32] |= 1U << next % 32;
+		merges++;
+	    }
+	}
+    memset(seen, 0, words * sizeof(uint32_t));
+
+    for (w = 0; w < words; w++)
+	for (bits = ~(free_map[w] | bad_map[w] | linked[w]); bits;
+	     bits &= bits - 1) {
+	    i = w * 32 + __builtin_ctz(bits);
+	    heads++;
+	    walk = i;
+	    seen[walk / 32] |= 1U << walk % 32;
+	    reached++;
+	    while ((next = link_of(fs, walk)) &&
+		   !(seen[next / 32] >> next % 32 & 1)) {
+		walk = next;
+		seen[walk / 32] |= 1U << walk % 32;
+		reached++;
+	    }
+	    if (!next)
+		continue;
+	    for (last = walk, walk = i; walk != last && walk != next;
+		 walk = link_of(fs, walk)) ;
+	    if (walk == next) {
+		mark_cycle(fs, next, seen);
+		cycles++;
+	    }
+	}
+
+    /* Only the clusters on pure cycles are left, if any */
+    for (w = 0; reached < used && w < words; w++)
+	for (bits = ~(free_map[w] | bad_map[w] | seen[w]); bits;
+	     bits &= ~seen[w]) {
+	    mark_cycle(fs, w * 32 + __builtin_ctz(bits), seen);
+	    cycles++;
+	}
+
+    free(linked);
+    free(seen);
+    if (verbose)
+	printf("FAT has %lu cluster chains, %lu merge points and %lu cycles.\n",
+	       (unsigned long)heads, (unsigned long)merges,
+	       (unsigned long)cycles);
+}
+
+int cyclic_cluster(DOS_FS * fs, uint32_t cluster)
+{
+    if (cluster > fs->data_clusters + 1)
+	die("Internal error: cluster out of range in cyclic_cluster() (%lu > %lu).",
+	    (unsigned long)cluster, (unsigned long)(fs->data_clusters + 1));
+    return cycle_map && cycle_map[cluster / 32] >> cluster % 32 & 1;
+}
+
+uint32_t free_run(DOS_FS * fs, uint32_t cluster, uint32_t max)
+{
+    uint32_t count = 0, pos, bits, length;
+
+    /* The padding bits past the last cluster are clear and end the run */
+    while (count < max && (pos = cluster + count) < fs->data_clusters + 2) {
+	bits = ~free_map[pos / 32] >> pos % 32;
+	length = bits ? __builtin_ctz(bits) : 32 - pos % 32;
+	count += length;
+	if (bits)
+	    break;
+    }
+    return count < max ? count : max;
+}
+
+uint32_t find_free(DOS_FS * fs, uint32_t near, uint32_t count)
+{
+    uint32_t total = fs->data_clusters + 2, first, length;
+
+    if (near < 2)
+	near = 2;
+    for (first = next_free(fs, near); first < total;
+	 first = next_free(fs, first + length))
+	if ((length = free_run(fs, first, count)) == count)
+	    return first;
+    for (first = next_free(fs, 2); first < near;
+	 first = next_free(fs, first + length))
+	if ((length = free_run(fs, first, count)) == count)
+	    return first;
+    return 0;
+}
+
+uint32_t find_cyclic(DOS_FS * fs, uint32_t first, uint32_t last)
+{
+    if (last > fs->data_clusters + 1)
+	die("Internal error: cluster out of range in find_cyclic() (%lu > %lu).",
+	    (unsigned long)last, (unsigned long)(fs->data_clusters + 1));
+    return cycle_map ? first_in_map(cycle_map, first, last) : last + 1;
+}
+
 /**
  * Build a bookkeeping structure from the partition's FAT table.
  * If the partition has multiple FATs and they don't agree, try to pick a winner,
- * and queue a command to overwrite the loser.
+ * and queue commands to overwrite the sectors in which the loser differs.
  * One error that is fixed here is a cluster that links to something out of range.
  *
  * @param[inout]    fs      Information about the filesystem
@@ -114,62 +931,74 @@ static void fix_first_cluster(DOS_FS * fs, void * first_cluster)
 void read_fat(DOS_FS * fs, int mode)
 {
     int eff_size, alloc_size;
-    uint32_t i;
-    void *first, *second = NULL;
-    int first_ok, second_ok = 0;
-    FAT_ENTRY first_media, second_media;
+    uint32_t i, words, sectors;
+    unsigned char *raw;
+    off_t second_start;
+    unsigned int raw_mapped;
+    int copy, use, first_ok, second_ok, *copy_ok, count;
+    FAT_RANGE *ranges;
     uint32_t total_num_clusters;
 
     if (fat_table > fs->nfats)
         die("Requested FAT table %ld does not exist.", fat_table);
-    if (fat_table > 2)
-        die("Reading FAT table greater than 2 is not implemented yet.");
 
     /* Clean up from previous pass */
     release_fat(fs);
 
     total_num_clusters = fs->data_clusters + 2;
-    eff_size = (total_num_clusters * fs->fat_bits + 7) / 8ULL;
+    eff_size = (total_num_clusters * (uint64_t)fs->fat_bits + 7) / 8;
 
     if (fs->fat_bits != 12)
 	    alloc_size = eff_size;
     else
 	    /* round up to an even number of FAT entries to avoid special
-	     * casing the last entry in get_fat() */
+	     * casing the last entry in decode_fat() */
 	    alloc_size = (total_num_clusters * 12 + 23) / 24 * 3;
 
-    first = alloc(alloc_size);
-    fs_read(fs->fat_start, eff_size, first);
-    get_fat(&first_media, first, 0, fs);
-    first_ok = (first_media.value & FAT_EXTD(fs)) == FAT_EXTD(fs);
-    if (fs->nfats > 1) {
-	second = alloc(alloc_size);
-	fs_read(fs->fat_start + fs->fat_size, eff_size, second);
-	get_fat(&second_media, second, 0, fs);
-	second_ok = (second_media.value & FAT_EXTD(fs)) == FAT_EXTD(fs);
-    }
+    /* Only the first entry of each copy is needed up front */
+    copy_ok = alloc(fs->nfats * sizeof(int));
+    for (copy = 0; copy < fs->nfats; copy++)
+	copy_ok[copy] = media_ok(fs, copy);
+    first_ok = copy_ok[0];
+    second_ok = fs->nfats > 1 && copy_ok[1];
+    second_start = fat_copy_start(fs, 1);
     if (mode != 0 && fat_table == 0) {
-        if (!first_ok && second && !second_ok)
+        if (!first_ok && fs->nfats == 2 && !second_ok)
             die("Both FATs appear to be corrupt. Giving up. Run fsck.fat with non-zero -F option.");
-        if (!first_ok && !second)
+        if (!first_ok && fs->nfats == 1)
             die("First FAT appears to be corrupt and second FAT does not exist. Giving up. Run fsck.fat with -F 1 option.");
+	for (copy = 0; copy < fs->nfats && !copy_ok[copy]; copy++) ;
+	if (copy == fs->nfats)
+	    die("All FATs appear to be corrupt. Giving up. Run fsck.fat with non-zero -F option.");
     }
-    if (mode == 0 && !first_ok && second && second_ok) {
-        /* In read-only mode if first FAT is corrupted and second is OK then use second FAT */
-        void *first_backup = first;
-        first = second;
-        second = first_backup;
-    }
-    if (mode != 0 && fat_table == 0 && second && memcmp(first, second, eff_size) != 0) {
+
+    /* Pick the copy that is loaded into memory */
+    use = 0;
+    if (mode != 0 && fat_table != 0)
+	use = fat_table - 1;
+    else if (mode == 0 && !first_ok)
+	/* In read-only mode if the first FAT is corrupted, use the first
+	 * one that is OK */
+	for (copy = 1; copy < fs->nfats; copy++)
+	    if (copy_ok[copy]) {
+		use = copy;
+		break;
+	    }
+    raw = load_fat(fat_copy_start(fs, use), eff_size, alloc_size, &raw_mapped);
+
+    if (mode != 0 && fat_table == 0 && fs->nfats > 2)
+	vote_fat(fs, raw, eff_size, copy_ok, mode);
+    if (mode != 0 && fat_table == 0 && fs->nfats == 2 &&
+	(ranges = compare_fat(second_start, raw, eff_size, &count))) {
 	if (mode != 2)
 	    die("FATs differ, please run fsck.fat");
 	if (first_ok && !second_ok) {
 	    printf("FATs differ - using first FAT.\n");
-	    fs_write(fs->fat_start + fs->fat_size, eff_size, first);
+	    write_ranges(second_start, raw, ranges, count);
 	} else if (!first_ok && second_ok) {
 	    printf("FATs differ - using second FAT.\n");
-	    fs_write(fs->fat_start, eff_size, second);
-	    memcpy(first, second, eff_size);
+	    read_ranges(second_start, raw, ranges, count);
+	    write_ranges(fs->fat_start, raw, ranges, count);
 	} else {
 	    if (first_ok && second_ok)
 		printf("FATs differ but appear to be intact.\n");
@@ -179,55 +1008,73 @@ void read_fat(DOS_FS * fs, int mode)
 			   2,
 			   1, "Use first FAT",
 			   2, "Use second FAT") == 1) {
-		if (!first_ok) {
-		    fix_first_cluster(fs, first);
-		    fs_write(fs->fat_start, (fs->fat_bits + 7) / 8, first);
-		}
-		fs_write(fs->fat_start + fs->fat_size, eff_size, first);
+		if (!first_ok)
+		    fix_media(fs, raw);
+		write_ranges(second_start, raw, ranges, count);
 	    } else {
-		if (!second_ok) {
-		    fix_first_cluster(fs, second);
-		    fs_write(fs->fat_start + fs->fat_size, (fs->fat_bits + 7) / 8, second);
-		}
-		fs_write(fs->fat_start, eff_size, second);
-		memcpy(first, second, eff_size);
+		read_ranges(second_start, raw, ranges, count);
+		if (!second_ok)
+		    fix_media(fs, raw);
+		write_ranges(fs->fat_start, raw, ranges, count);
 	    }
 	}
+	free(ranges);
     }
     if (mode != 0 && fat_table != 0) {
-        if (fat_table == 1) {
-            printf("Using first FAT.\n");
-            if (!first_ok) {
-                fix_first_cluster(fs, first);
-                fs_write(fs->fat_start, (fs->fat_bits + 7) / 8, first);
-            }
-            if (second && memcmp(first, second, eff_size) != 0)
-                fs_write(fs->fat_start + fs->fat_size, eff_size, first);
-        } else if (fat_table == 2) {
-            printf("Using second FAT.\n");
-            if (!second_ok) {
-                fix_first_cluster(fs, second);
-                fs_write(fs->fat_start + fs->fat_size, (fs->fat_bits + 7) / 8, second);
-            }
-            if (memcmp(first, second, eff_size) != 0) {
-                fs_write(fs->fat_start, eff_size, second);
-                memcpy(first, second, eff_size);
-            }
-        }
-    }
-    if (second) {
-	free(second);
-    }
-    fs->fat = (unsigned char *)first;
-
-    fs->cluster_owner = alloc(total_num_clusters * sizeof(DOS_FILE *));
-    memset(fs->cluster_owner, 0, (total_num_clusters * sizeof(DOS_FILE *)));
+	if (fat_table == 1)
+	    printf("Using first FAT.\n");
+	else if (fat_table == 2)
+	    printf("Using second FAT.\n");
+	else
+	    printf("Using FAT %ld.\n", fat_table);
+	if (!copy_ok[use]) {
+	    fix_first_cluster(fs, raw);
+	    fs_write(fat_copy_start(fs, use), (fs->fat_bits + 7) / 8, raw);
+	}
+	/* Copy the chosen FAT over the sectors in which the others differ */
+	for (copy = 0; copy < fs->nfats; copy++)
+	    if (copy != use &&
+		(ranges = compare_fat(fat_copy_start(fs, copy), raw, eff_size,
+				      &count))) {
+		write_ranges(fat_copy_start(fs, copy), raw, ranges, count);
+		free(ranges);
+	    }
+    }
+    free(copy_ok);
+    fs->fat = decode_fat(fs, raw, &raw_mapped);
+    fs->fat_map_size = raw_mapped;
+    if (fs->fat_map_size)
+	fs_map_random(fs->fat, fs->fat_map_size);
+
+    /* Two words of the ownership table per bitmap word */
+    words = (total_num_clusters + 31) / 32;
+    fs->cluster_owner = alloc(words * 2 * sizeof(uint32_t));
+    memset(fs->cluster_owner, 0, words * 2 * sizeof(uint32_t));
+
+    sectors = (eff_size + fs->sector_size - 1) / fs->sector_size;
+    dirty_map = alloc((sectors + 31) / 32 * sizeof(uint32_t));
+    memset(dirty_map, 0, (sectors + 31) / 32 * sizeof(uint32_t));
+
+    free_map = alloc(words * sizeof(uint32_t));
+    bad_map = alloc(words * sizeof(uint32_t));
+    run_map = alloc(words * sizeof(uint32_t));
+    build_fat_bitmap(fs->fat, total_num_clusters,
+		     fs->fat_bits == 32 ? 0xfffffff : 0xffffffff,
+		     FAT_MIN_BAD(fs), FAT_MAX_BAD(fs), free_map, bad_map,
+		     run_map);
+    run_map[0] &= ~3U;
+    free_map[0] &= ~3U;
+    bad_map[0] |= 3;
+    if (total_num_clusters % 32)
+	bad_map[words - 1] |= ~0U << total_num_clusters % 32;
+    build_free_levels(words);
 
     if (mode == 0)
         return;
 
     /* Truncate any cluster chains that link to something out of range */
-    for (i = 2; i < fs->data_clusters + 2; i++) {
+    for (i = 2; (i = find_invalid(fs, i, total_num_clusters)) <
+	 total_num_clusters; i++) {
 	FAT_ENTRY curEntry;
 	get_fat(&curEntry, fs->fat, i, fs);
 	if (curEntry.value == 1) {
@@ -250,6 +1097,8 @@ void read_fat(DOS_FS * fs, int mode)
 	    set_fat(fs, i, -1);
 	}
     }
+    if (mode == 2)
+	scan_graph(fs);
 }
 
 /**
@@ -267,10 +1116,6 @@ void read_fat(DOS_FS * fs, int mode)
  */
 void set_fat(DOS_FS * fs, uint32_t cluster, int32_t new)
 {
-    unsigned char *data = NULL;
-    int size;
-    off_t offs;
-
     if (cluster > fs->data_clusters + 1) {
 	die("Internal error: cluster out of range in set_fat() (%lu > %lu).",
 		(unsigned long)cluster, (unsigned long)(fs->data_clusters + 1));
@@ -285,53 +1130,26 @@ void set_fat(DOS_FS * fs, uint32_t cluster, int32_t new)
 		(unsigned long)new, (unsigned long)(fs->data_clusters + 1));
     }
 
-    switch (fs->fat_bits) {
-    case 12:
-	data = fs->fat + cluster * 3 / 2;
-	offs = fs->fat_start + cluster * 3 / 2;
-	if (cluster & 1) {
-	    FAT_ENTRY prevEntry;
-	    get_fat(&prevEntry, fs->fat, cluster - 1, fs);
-	    data[0] = ((new & 0xf) << 4) | (prevEntry.value >> 8);
-	    data[1] = new >> 4;
-	} else {
-	    FAT_ENTRY subseqEntry;
-	    if (cluster != fs->data_clusters + 1)
-		get_fat(&subseqEntry, fs->fat, cluster + 1, fs);
-	    else
-		subseqEntry.value = 0;
-	    data[0] = new & 0xff;
-	    data[1] = (new >> 8) | ((0xff & subseqEntry.value) << 4);
-	}
-	size = 2;
-	break;
-    case 16:
-	data = fs->fat + cluster * 2;
-	offs = fs->fat_start + cluster * 2;
-	*(unsigned short *)data = htole16(new);
-	size = 2;
-	break;
-    case 32:
-	{
-	    FAT_ENTRY curEntry;
-	    get_fat(&curEntry, fs->fat, cluster, fs);
-
-	    data = fs->fat + cluster * 4;
-	    offs = fs->fat_start + cluster * 4;
-	    /* According to M$, the high 4 bits of a FAT32 entry are reserved and
-	     * are not part of the cluster number. So we never touch them. */
-	    *(uint32_t *)data = htole32((new & 0xfffffff) |
-					     (curEntry.reserved << 28));
-	    size = 4;
-	}
-	break;
-    default:
-	die("Bad FAT entry size: %d bits.", fs->fat_bits);
-    }
-    fs_write(offs, size, data);
-    if (fs->nfats > 1) {
-	fs_write(offs + fs->fat_size, size, data);
+    if (fs->fat_bits == 32)
+	/* According to M$, the high 4 bits of a FAT32 entry are reserved and
+	 * are not part of the cluster number. So we never touch them. */
+	fs->fat[cluster] = (fs->fat[cluster] & 0xf0000000) | (new & 0xfffffff);
+    else
+	fs->fat[cluster] = new;
+    update_bitmap(fs, cluster);
+    mark_dirty(fs, cluster);
+}
+
+void set_fat_entry(DOS_FS * fs, uint32_t cluster, uint32_t value)
+{
+    if (cluster > fs->data_clusters + 1) {
+	die("Internal error: cluster out of range in set_fat_entry() (%lu > %lu).",
+		(unsigned long)cluster, (unsigned long)(fs->data_clusters + 1));
     }
+
+    fs->fat[cluster] = value;
+    update_bitmap(fs, cluster);
+    mark_dirty(fs, cluster);
 }
 
 int bad_cluster(DOS_FS * fs, uint32_t cluster)
@@ -365,6 +1183,33 @@ uint32_t next_cluster(DOS_FS * fs, uint32_t cluster)
     return FAT_IS_EOF(fs, value) ? -1 : value;
 }
 
+/**
+ * Find the extent of a cluster chain that starts at a cluster, the run of
+ * consecutive clusters each of which links to the one right after it.
+ *
+ * @param[in]   fs          Information about the filesystem
+ * @param[in]	cluster     First cluster of the extent
+ *
+ * @return  The last cluster of the extent, CLUSTER itself if it does not link
+ *	    to the cluster after it. The chain goes on at next_cluster() of it.
+ */
+uint32_t chain_run(DOS_FS * fs, uint32_t cluster)
+{
+    uint32_t last = fs->data_clusters + 1, word = cluster / 32, bits;
+
+    if (cluster > last)
+	die("Internal error: cluster out of range in chain_run() (%lu > %lu).",
+	    (unsigned long)cluster, (unsigned long)last);
+    bits = ~run_map[word] & ~0U << cluster % 32;
+    while (!bits) {
+	if (++word > last / 32)
+	    return last;
+	bits = ~run_map[word];
+    }
+    cluster = word * 32 + __builtin_ctz(bits);
+    return cluster < last ? cluster : last;
+}
+
 off_t cluster_start(DOS_FS * fs, uint32_t cluster)
 {
     /* TODO: check overflow */
@@ -372,47 +1217,87 @@ off_t cluster_start(DOS_FS * fs, uint32_t cluster)
 }
 
 /**
- * Update internal bookkeeping to show that the specified cluster belongs
- * to the specified dentry.
+ * Update internal bookkeeping to show how the specified cluster is owned.
  *
  * @param[in,out]   fs          Information about the filesystem
  * @param[in]	    cluster     Cluster being assigned
- * @param[in]	    owner       Information on dentry that owns this cluster
- *                              (may be NULL)
+ * @param[in]	    owner       Kind of ownership, one of the OWNER_* values
  */
-void set_owner(DOS_FS * fs, uint32_t cluster, DOS_FILE * owner)
+void set_owner(DOS_FS * fs, uint32_t cluster, int owner)
 {
+    uint32_t *word;
+    int shift = cluster % 16 * 2;
+
     if (fs->cluster_owner == NULL)
 	die("Internal error: attempt to set owner in non-existent table");
 
-    if (owner && fs->cluster_owner[cluster]
-	&& (fs->cluster_owner[cluster] != owner))
-	die("Internal error: attempt to change file owner");
-    fs->cluster_owner[cluster] = owner;
+    word = &fs->cluster_owner[cluster / 16];
+    *word = (*word & ~(3U << shift)) | (uint32_t)owner << shift;
 }
 
-DOS_FILE *get_owner(DOS_FS * fs, uint32_t cluster)
+int get_owner(DOS_FS * fs, uint32_t cluster)
 {
     if (fs->cluster_owner == NULL)
-	return NULL;
+	return OWNER_NONE;
     else
-	return fs->cluster_owner[cluster];
+	return owner_of(fs->cluster_owner, cluster);
+}
+
+void set_owner_run(DOS_FS * fs, uint32_t first, uint32_t last, int owner)
+{
+    if (fs->cluster_owner == NULL)
+	die("Internal error: attempt to set owner in non-existent table");
+
+    while (first <= last)
+	if (first % 16 == 0 && last - first >= 15) {
+	    /* All 16 clusters of the word at once */
+	    fs->cluster_owner[first / 16] = (uint32_t)owner * 0x55555555;
+	    first += 16;
+	} else
+	    set_owner(fs, first++, owner);
+}
+
+uint32_t find_owned(DOS_FS * fs, uint32_t first, uint32_t last)
+{
+    uint32_t word, bits;
+
+    if (fs->cluster_owner == NULL)
+	return last + 1;
+    for (word = first / 16; word <= last / 16; word++) {
+	bits = owned_half(fs->cluster_owner[word]);
+	if (word == first / 16)
+	    bits &= ~0U << first % 16;
+	if (bits) {
+	    first = word * 16 + __builtin_ctz(bits);
+	    return first <= last ? first : last + 1;
+	}
+    }
+    return last + 1;
 }
 
 void fix_bad(DOS_FS * fs)
 {
-    uint32_t i;
+    uint32_t i, cluster[TEST_BATCH];
+    off_t pos[TEST_BATCH];
+    int okay[TEST_BATCH];
+    int n, j;
 
     if (verbose)
 	printf("Checking for bad clusters.\n");
-    for (i = 2; i < fs->data_clusters + 2; i++) {
-	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
-
-	if (!get_owner(fs, i) && !FAT_IS_BAD(fs, curEntry.value))
-	    if (!fs_test(cluster_start(fs, i), fs->cluster_size)) {
-		printf("Cluster %lu is unreadable.\n", (unsigned long)i);
-		set_fat(fs, i, -2);
+    for (i = 2; i < fs->data_clusters + 2;) {
+	/* Test the clusters in batches, so they can be read in parallel */
+	for (n = 0; n < TEST_BATCH &&
+	     (i = find_cluster(fs, i, FIND_UNUSED)) < fs->data_clusters + 2;
+	     i++) {
+	    cluster[n] = i;
+	    pos[n++] = cluster_start(fs, i);
+	}
+	fs_test_many(pos, n, fs->cluster_size, okay);
+	for (j = 0; j < n; j++)
+	    if (!okay[j]) {
+		printf("Cluster %lu is unreadable.\n",
+		       (unsigned long)cluster[j]);
+		set_fat(fs, cluster[j], -2);
 	    }
     }
 }
@@ -425,15 +1310,10 @@ void reclaim_free(DOS_FS * fs)
     if (verbose)
 	printf("Checking for unused clusters.\n");
     reclaimed = 0;
-    for (i = 2; i < fs->data_clusters + 2; i++) {
-	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
-
-	if (!get_owner(fs, i) && curEntry.value &&
-	    !FAT_IS_BAD(fs, curEntry.value)) {
-	    set_fat(fs, i, 0);
-	    reclaimed++;
-	}
+    for (i = 2; (i = find_cluster(fs, i, FIND_USED)) < fs->data_clusters + 2;
+	 i++) {
+	set_fat(fs, i, 0);
+	reclaimed++;
     }
     if (reclaimed)
 	printf("Reclaimed %d unused cluster%s (%llu bytes).\n", (int)reclaimed,
@@ -442,89 +1322,65 @@ void reclaim_free(DOS_FS * fs)
 }
 
 /**
- * Assign the specified owner to all orphan chains (except cycles).
- * Break cross-links between orphan chains.
+ * Walk the orphan chain from HEAD, marking its clusters as owned by
+ * OWNER_ORPHAN. If the chain runs into a cluster that is already tagged,
+ * because it is cross-linked with an earlier chain or loops back into itself,
+ * it is cut off before that cluster.
  *
- * @param[in,out]   fs             Information about the filesystem
- * @param[in]	    owner          dentry to be assigned ownership of orphans
- * @param[in,out]   num_refs	   For each orphan cluster [index], how many
- *				   clusters link to it.
- * @param[in]	    start_cluster  Where to start scanning for orphans
+ * @param[in,out]   fs      Information about the filesystem
+ * @param[in]	    head    First cluster of the chain
  */
-static void tag_free(DOS_FS * fs, DOS_FILE * owner, uint32_t *num_refs,
-		     uint32_t start_cluster)
+static void tag_chain(DOS_FS * fs, uint32_t head)
 {
-    int prev;
-    uint32_t i, walk;
-
-    if (start_cluster == 0)
-	start_cluster = 2;
-
-    for (i = start_cluster; i < fs->data_clusters + 2; i++) {
-	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
+    uint32_t prev = 0, walk;
 
-	/* If the current entry is the head of an un-owned chain... */
-	if (curEntry.value && !FAT_IS_BAD(fs, curEntry.value) &&
-	    !get_owner(fs, i) && !num_refs[i]) {
-	    prev = 0;
-	    /* Walk the chain, claiming ownership as we go */
-	    for (walk = i; walk != -1; walk = next_cluster(fs, walk)) {
-		if (!get_owner(fs, walk)) {
-		    set_owner(fs, walk, owner);
-		} else {
-		    /* We've run into cross-links between orphaned chains,
-		     * or a cycle with a tail.
-		     * Terminate this orphan chain (break the link)
-		     */
-		    set_fat(fs, prev, -1);
-
-		    /* This is not necessary because 'walk' is owned and thus
-		     * will never become the head of a chain (the only case
-		     * that would matter during reclaim to files).
-		     * It's easier to decrement than to prove that it's
-		     * unnecessary.
-		     */
-		    num_refs[walk]--;
-		    break;
-		}
-		prev = walk;
-	    }
+    for (walk = head; walk != -1; walk = next_cluster(fs, walk)) {
+	if (get_owner(fs, walk)) {
+	    set_fat(fs, prev, -1);
+	    break;
 	}
+	set_owner(fs, walk, OWNER_ORPHAN);
+	prev = walk;
     }
 }
 
 /**
  * Recover orphan chains to files, handling any cycles or cross-links.
  *
+ * The orphans form a graph in which every cluster links to at most one
+ * other. It is handled in three linear passes: finding the clusters another
+ * orphan links to, tagging the chains from every head (an orphan nothing
+ * links to) in cluster order, and breaking what is left, which can only be
+ * cycles, at their lowest cluster.
+ *
  * @param[in,out]   fs             Information about the filesystem
  */
 void reclaim_file(DOS_FS * fs)
 {
-    DOS_FILE orphan;
     int reclaimed, files;
-    int changed = 0;
     uint32_t i, next, walk;
-    uint32_t *num_refs = NULL;	/* Only for orphaned clusters */
-    uint32_t total_num_clusters;
+    uint32_t *linked;	/* Orphans linked to by another one, 1 bit each */
+    uint32_t total_num_clusters, words;
 
     if (verbose)
 	printf("Reclaiming unconnected clusters.\n");
 
     total_num_clusters = fs->data_clusters + 2;
-    num_refs = alloc(total_num_clusters * sizeof(uint32_t));
-    memset(num_refs, 0, (total_num_clusters * sizeof(uint32_t)));
+    words = (total_num_clusters + 31) / 32;
+    linked = alloc(words * sizeof(uint32_t));
+    memset(linked, 0, words * sizeof(uint32_t));
 
     /* Guarantee that all orphan chains (except cycles) end cleanly
      * with an end-of-chain mark.
      */
 
-    for (i = 2; i < total_num_clusters; i++) {
+    for (i = 2; (i = find_cluster(fs, i, FIND_USED)) < total_num_clusters;
+	 i++) {
 	FAT_ENTRY curEntry;
 	get_fat(&curEntry, fs->fat, i, fs);
 
 	next = curEntry.value;
-	if (!get_owner(fs, i) && next && next < fs->data_clusters + 2) {
+	if (next < fs->data_clusters + 2) {
 	    /* Cluster is linked, but not owned (orphan) */
 	    FAT_ENTRY nextEntry;
 	    get_fat(&nextEntry, fs->fat, next, fs);
@@ -536,45 +1392,35 @@ void reclaim_file(DOS_FS * fs)
 		FAT_IS_BAD(fs, nextEntry.value))
 		set_fat(fs, i, -1);
 	    else
-		num_refs[next]++;
+		linked[next / 32] |= 1U << next % 32;
 	}
     }
 
-    /* Scan until all the orphans are accounted for,
-     * and all cycles and cross-links are broken
-     */
-    do {
-	tag_free(fs, &orphan, num_refs, changed);
-	changed = 0;
-
-	/* Any unaccounted-for orphans must be part of a cycle */
-	for (i = 2; i < total_num_clusters; i++) {
-	    FAT_ENTRY curEntry;
-	    get_fat(&curEntry, fs->fat, i, fs);
-
-	    if (curEntry.value && !FAT_IS_BAD(fs, curEntry.value) &&
-		!get_owner(fs, i)) {
-		if (!num_refs[curEntry.value]--)
-		    die("Internal error: num_refs going below zero");
-		set_fat(fs, i, -1);
-		changed = curEntry.value;
-		printf("Broke cycle at cluster %lu in free chain.\n", (unsigned long)i);
-
-		/* If we've created a new chain head,
-		 * tag_free() can claim it
-		 */
-		if (num_refs[curEntry.value] == 0)
-		    break;
-	    }
-	}
+    /* Tag the chains from their heads. Breaking a cross-link never turns the
+     * cluster behind it into a head, because the chain that tagged it first
+     * still links to it. So a bit per cluster does instead of a count. */
+    for (i = 2; (i = find_cluster(fs, i, FIND_USED)) < total_num_clusters;
+	 i++)
+	if (!(linked[i / 32] >> i % 32 & 1))
+	    tag_chain(fs, i);
+
+    /* Any unaccounted-for orphans must be part of a cycle. The cluster
+     * after the break becomes the head of the chain. */
+    for (i = 2; (i = find_cluster(fs, i, FIND_USED)) < total_num_clusters;
+	 i++) {
+	next = next_cluster(fs, i);
+	set_fat(fs, i, -1);
+	linked[next / 32] &= ~(1U << next % 32);
+	printf("Broke cycle at cluster %lu in free chain.\n", (unsigned long)i);
+	tag_chain(fs, next);
     }
-    while (changed);
 
     /* Now we can start recovery */
     files = reclaimed = 0;
     for (i = 2; i < total_num_clusters; i++)
 	/* If this cluster is the head of an orphan chain... */
-	if (get_owner(fs, i) == &orphan && !num_refs[i]) {
+	if (get_owner(fs, i) == OWNER_ORPHAN &&
+	    !(linked[i / 32] >> i % 32 & 1)) {
 	    DIR_ENT de;
 	    off_t offset;
 	    files++;
@@ -595,22 +1441,75 @@ void reclaim_file(DOS_FS * fs)
 	       (unsigned long long)reclaimed * fs->cluster_size, files,
 	       files == 1 ? "" : "s");
 
-    free(num_refs);
+    free(linked);
 }
 
-uint32_t update_free(DOS_FS * fs)
+/* Returns the first cluster of the longest extent of free clusters, the
+ * lowest of several as long, or 0 if no cluster is free. */
+static uint32_t largest_free(DOS_FS * fs)
 {
-    uint32_t i;
-    uint32_t free = 0;
-    int do_set = 0;
+    uint32_t total = fs->data_clusters + 2, first, length, best = 0, most = 0;
 
-    for (i = 2; i < fs->data_clusters + 2; i++) {
-	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
+    for (first = next_free(fs, 2); first < total;
+	 first = next_free(fs, first + length))
+	if ((length = free_run(fs, first, total)) > most) {
+	    best = first;
+	    most = length;
+	}
+    return best;
+}
 
-	if (!get_owner(fs, i) && !FAT_IS_BAD(fs, curEntry.value))
-	    ++free;
+/* Checks the FSINFO allocation hint. Drivers take it for the most recently
+ * allocated cluster and look for free ones from the cluster after it on.
+ * 0xFFFFFFFF means the hint is unknown, and a used cluster after the hint is
+ * normal, as the next allocation usually follows the last one. Only a hint
+ * out of range, or one with no free cluster after it up to the last cluster
+ * (which wraps around to cluster 2), makes the first write after mount search
+ * in vain; a hint just before the longest free extent is set instead. */
+static void check_free_hint(DOS_FS * fs)
+{
+    uint32_t total = fs->data_clusters + 2, hint = fs->free_hint;
+    uint32_t start, good, le_hint;
+
+    if (!(start = largest_free(fs)))
+	return;			/* nothing left to allocate anyway */
+    /* Cluster 2 comes after the last cluster */
+    good = start > 2 ? start - 1 : total - 1;
+
+    if (hint == 0xFFFFFFFF) {
+	if (verbose)
+	    printf("Free cluster hint is unknown.\n");
+	return;
+    }
+    if (hint < 2 || hint >= total)
+	printf("Free cluster hint %lu is out of range (should be %lu)\n",
+	       (unsigned long)hint, (unsigned long)good);
+    else if (hint + 1 < total && next_free(fs, hint + 1) >= total)
+	printf("Free cluster hint %lu is followed by no free clusters "
+	       "(should be %lu)\n", (unsigned long)hint, (unsigned long)good);
+    else {
+	if (verbose)
+	    printf("Free cluster hint is %lu.\n", (unsigned long)hint);
+	return;
     }
+    if (!rw || get_choice(1, "  Auto-correcting.",
+			  2,
+			  1, "Correct",
+			  2, "Don't correct") != 1)
+	return;
+
+    le_hint = htole32(good);
+    fs->free_hint = good;
+    fs_write(fs->fsinfo_start + offsetof(struct info_sector, next_cluster),
+	     sizeof(le_hint), &le_hint);
+}
+
+uint32_t update_free(DOS_FS * fs)
+{
+    uint32_t free;
+    int do_set = 0;
+
+    free = count_unused(fs);
 
     if (!fs->fsinfo_start)
 	return free;
@@ -645,5 +1544,6 @@ uint32_t update_free(DOS_FS * fs)
 		 sizeof(le_free), &le_free);
     }
 
+    check_free_hint(fs);
     return free;
 }
@@ -35,7 +35,8 @@ void release_fat(DOS_FS * fs);
 
 void get_fat(FAT_ENTRY * entry, void *fat, uint32_t cluster, DOS_FS * fs);
 
-/* Retrieve the FAT entry (next chained cluster) for CLUSTER. */
+/* Retrieve the FAT entry (next chained cluster) for CLUSTER from the decoded
+   FAT, fs->fat. */
 
 void set_fat(DOS_FS * fs, uint32_t cluster, int32_t new);
 
@@ -43,6 +44,11 @@ void set_fat(DOS_FS * fs, uint32_t cluster, int32_t new);
    values of NEW are -1 (EOF, 0xff8 or 0xfff8) and -2 (bad sector, 0xff7 or
    0xfff7) */
 
+void set_fat_entry(DOS_FS * fs, uint32_t cluster, uint32_t value);
+
+/* Stores VALUE as the entry of CLUSTER without interpreting it, including the
+   reserved bits of FAT32 entries. Meant for the flags in entry 1. */
+
 int bad_cluster(DOS_FS * fs, uint32_t cluster);
 
 /* Returns a non-zero integer if the CLUSTERth cluster is marked as bad or zero
@@ -54,20 +60,64 @@ uint32_t next_cluster(DOS_FS * fs, uint32_t cluster);
    last cluster of the respective cluster chain. CLUSTER must not be a bad
    cluster. */
 
+uint32_t chain_run(DOS_FS * fs, uint32_t cluster);
+
+/* Returns the last cluster of the extent starting at CLUSTER, the run of
+   consecutive clusters each linking to the one right after it. This is
+   CLUSTER itself if it does not link to CLUSTER + 1. Every cluster of an
+   extent but the last is neither free nor bad. */
+
 off_t cluster_start(DOS_FS * fs, uint32_t cluster);
 
 /* Returns the byte offset of CLUSTER, relative to the respective device. */
 
-void set_owner(DOS_FS * fs, uint32_t cluster, DOS_FILE * owner);
+int cyclic_cluster(DOS_FS * fs, uint32_t cluster);
+
+/* Returns a non-zero integer if CLUSTER was on a cycle of cluster chains when
+   read_fat() repaired the FAT, or zero otherwise. Clusters that have dropped
+   out of a cycle since may still be reported. */
+
+uint32_t free_run(DOS_FS * fs, uint32_t cluster, uint32_t max);
+
+/* Returns the number of consecutive free clusters from CLUSTER on, at most
+   MAX. */
+
+uint32_t find_free(DOS_FS * fs, uint32_t near, uint32_t count);
+
+/* Returns the first of COUNT consecutive free clusters, looking from NEAR up
+   to the last cluster and then from the first cluster on, or 0 if there are
+   none. The clusters stay free until they are linked with set_fat(). */
+
+uint32_t find_cyclic(DOS_FS * fs, uint32_t first, uint32_t last);
+
+/* Returns the first cluster from FIRST up to LAST for which cyclic_cluster()
+   is true, or LAST + 1 if there is none. */
+
+/* Kinds of cluster ownership. Only the kind is stored for each cluster; the
+   file owning a cluster is looked up by following cluster chains when it is
+   needed to report a cross-link. */
+#define OWNER_NONE	0	/* not owned */
+#define OWNER_FILE	1	/* owned by a file that has been checked */
+#define OWNER_ORPHAN	2	/* part of an orphan chain being reclaimed */
+
+void set_owner(DOS_FS * fs, uint32_t cluster, int owner);
+
+/* Sets the ownership of the respective cluster to OWNER, one of the OWNER_*
+   values. */
+
+int get_owner(DOS_FS * fs, uint32_t cluster);
+
+/* Returns the ownership of the respective cluster, OWNER_NONE (zero) if the
+   cluster has no owner. */
+
+void set_owner_run(DOS_FS * fs, uint32_t first, uint32_t last, int owner);
 
-/* Sets the owner pointer of the respective cluster to OWNER. If OWNER was NULL
-   before, it can be set to NULL or any non-NULL value. Otherwise, only NULL is
-   accepted as the new value. */
+/* Sets the ownership of the clusters FIRST up to LAST to OWNER. */
 
-DOS_FILE *get_owner(DOS_FS * fs, uint32_t cluster);
+uint32_t find_owned(DOS_FS * fs, uint32_t first, uint32_t last);
 
-/* Returns the owner of the respective cluster or NULL if the cluster has no
-   owner. */
+/* Returns the first cluster from FIRST up to LAST that has an owner, or
+   LAST + 1 if there is none. */
 
 void fix_bad(DOS_FS * fs);
 
@@ -85,6 +135,6 @@ void reclaim_file(DOS_FS * fs);
 
 uint32_t update_free(DOS_FS * fs);
 
-/* Updates free cluster count in FSINFO sector. */
+/* Updates free cluster count and allocation hint in FSINFO sector. */
 
 #endif
@@ -0,0 +1,224 @@
+/* fat_bitmap.c - Classify the whole FAT into free and bad cluster bitmaps
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+   The complete text of the GNU General Public License
+   can be found in /usr/share/common-licenses/GPL-3 file.
+*/
+
+/*
+ * The kernels turn 32 decoded FAT entries at a time into one word of each
+ * bitmap. Entry N is compared with N + 1 for the run map, the vector kernels
+ * keep the numbers of the entries they hold in a vector for that. The vector
+ * kernels compare several entries at once and gather the comparison results
+ * into bits: SSE2 and AVX2 with movemask, NEON by adding up the lanes
+ * weighted with their bit values. The kernel is picked on the first call from
+ * what the CPU supports, the portable one is used everywhere else.
+ */
+
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define USE_NEON
+#include <arm_neon.h>
+#endif
+
+#include "fat_bitmap.h"
+
+typedef void (*BITMAP_KERNEL)(const uint32_t *fat, uint32_t words,
+			      uint32_t mask, uint32_t min_bad,
+			      uint32_t bad_range, uint32_t *free_map,
+			      uint32_t *bad_map, uint32_t *run_map);
+
+
+static void bitmap_portable(const uint32_t *fat, uint32_t words,
+			    uint32_t mask, uint32_t min_bad, uint32_t bad_range,
+			    uint32_t *free_map, uint32_t *bad_map,
+			    uint32_t *run_map)
+{
+    uint32_t w, j, value, free_bits, bad_bits, run_bits;
+
+    for (w = 0; w < words; w++, fat += 32) {
+	free_bits = bad_bits = run_bits = 0;
+	for (j = 0; j < 32; j++) {
+	    value = fat[j] & mask;
+	    free_bits |= (uint32_t)(value == 0) << j;
+	    bad_bits |= (uint32_t)(value - min_bad <= bad_range) << j;
+	    run_bits |= (uint32_t)(value == w * 32 + j + 1) << j;
+	}
+	free_map[w] = free_bits;
+	bad_map[w] = bad_bits;
+	run_map[w] = run_bits;
+    }
+}
+
+#ifdef USE_X86
+
+__attribute__ ((target("sse2")))
+static void bitmap_sse2(const uint32_t *fat, uint32_t words,
+			uint32_t mask, uint32_t min_bad, uint32_t bad_range,
+			uint32_t *free_map, uint32_t *bad_map, uint32_t *run_map)
+{
+    /* SSE2 only compares signed, so flip the sign bits of both sides */
+    const __m128i vmask = _mm_set1_epi32(mask);
+    const __m128i vmin = _mm_set1_epi32(min_bad);
+    const __m128i vsign = _mm_set1_epi32(0x80000000);
+    const __m128i vrange = _mm_set1_epi32(bad_range ^ 0x80000000);
+    const __m128i vzero = _mm_setzero_si128();
+    const __m128i vstep = _mm_set1_epi32(4);
+    uint32_t w, j, free_bits, good_bits, run_bits;
+    __m128i value, offset, vnext = _mm_setr_epi32(1, 2, 3, 4);
+
+    for (w = 0; w < words; w++, fat += 32) {
+	free_bits = good_bits = run_bits = 0;
+	for (j = 0; j < 32; j += 4) {
+	    value = _mm_and_si128(_mm_loadu_si128((const __m128i *)&fat[j]),
+				  vmask);
+	    offset = _mm_xor_si128(_mm_sub_epi32(value, vmin), vsign);
+	    free_bits |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(
+				_mm_cmpeq_epi32(value, vzero))) << j;
+	    good_bits |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(
+				_mm_cmpgt_epi32(offset, vrange))) << j;
+	    run_bits |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(
+				_mm_cmpeq_epi32(value, vnext))) << j;
+	    vnext = _mm_add_epi32(vnext, vstep);
+	}
+	free_map[w] = free_bits;
+	bad_map[w] = ~good_bits;
+	run_map[w] = run_bits;
+    }
+}
+
+__attribute__ ((target("avx2")))
+static void bitmap_avx2(const uint32_t *fat, uint32_t words,
+			uint32_t mask, uint32_t min_bad, uint32_t bad_range,
+			uint32_t *free_map, uint32_t *bad_map, uint32_t *run_map)
+{
+    const __m256i vmask = _mm256_set1_epi32(mask);
+    const __m256i vmin = _mm256_set1_epi32(min_bad);
+    const __m256i vrange = _mm256_set1_epi32(bad_range);
+    const __m256i vzero = _mm256_setzero_si256();
+    const __m256i vstep = _mm256_set1_epi32(8);
+    uint32_t w, j, free_bits, bad_bits, run_bits;
+    __m256i value, offset, vnext = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8);
+
+    for (w = 0; w < words; w++, fat += 32) {
+	free_bits = bad_bits = run_bits = 0;
+	for (j = 0; j < 32; j += 8) {
+	    value = _mm256_and_si256(
+			_mm256_loadu_si256((const __m256i *)&fat[j]), vmask);
+	    offset = _mm256_sub_epi32(value, vmin);
+	    free_bits |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_cmpeq_epi32(value, vzero))) << j;
+	    /* offset <= bad_range, unsigned */
+	    bad_bits |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_cmpeq_epi32(_mm256_min_epu32(offset,
+								    vrange),
+						   offset))) << j;
+	    run_bits |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_cmpeq_epi32(value, vnext))) << j;
+	    vnext = _mm256_add_epi32(vnext, vstep);
+	}
+	free_map[w] = free_bits;
+	bad_map[w] = bad_bits;
+	run_map[w] = run_bits;
+    }
+}
+
+static BITMAP_KERNEL select_kernel(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return bitmap_avx2;
+    if (__builtin_cpu_supports("sse2"))
+	return bitmap_sse2;
+    return bitmap_portable;
+}
+
+#elif defined(USE_NEON)
+
+static void bitmap_neon(const uint32_t *fat, uint32_t words,
+			uint32_t mask, uint32_t min_bad, uint32_t bad_range,
+			uint32_t *free_map, uint32_t *bad_map, uint32_t *run_map)
+{
+    static const uint32_t weights[4] = { 1, 2, 4, 8 };
+    static const uint32_t first[4] = { 1, 2, 3, 4 };
+    const uint32x4_t vweight = vld1q_u32(weights);
+    const uint32x4_t vmask = vdupq_n_u32(mask);
+    const uint32x4_t vmin = vdupq_n_u32(min_bad);
+    const uint32x4_t vrange = vdupq_n_u32(bad_range);
+    const uint32x4_t vstep = vdupq_n_u32(4);
+    uint32_t w, j, free_bits, bad_bits, run_bits;
+    uint32x4_t value, vnext = vld1q_u32(first);
+
+    for (w = 0; w < words; w++, fat += 32) {
+	free_bits = bad_bits = run_bits = 0;
+	for (j = 0; j < 32; j += 4) {
+	    value = vandq_u32(vld1q_u32(&fat[j]), vmask);
+	    free_bits |= vaddvq_u32(vandq_u32(vceqzq_u32(value),
+					      vweight)) << j;
+	    bad_bits |= vaddvq_u32(vandq_u32(vcleq_u32(vsubq_u32(value, vmin),
+						       vrange),
+					     vweight)) << j;
+	    run_bits |= vaddvq_u32(vandq_u32(vceqq_u32(value, vnext),
+					     vweight)) << j;
+	    vnext = vaddq_u32(vnext, vstep);
+	}
+	free_map[w] = free_bits;
+	bad_map[w] = bad_bits;
+	run_map[w] = run_bits;
+    }
+}
+
+static BITMAP_KERNEL select_kernel(void)
+{
+    return bitmap_neon;
+}
+
+#else
+
+static BITMAP_KERNEL select_kernel(void)
+{
+    return bitmap_portable;
+}
+
+#endif
+
+void build_fat_bitmap(const uint32_t *fat, uint32_t count, uint32_t mask,
+		      uint32_t min_bad, uint32_t max_bad,
+		      uint32_t *free_map, uint32_t *bad_map, uint32_t *run_map)
+{
+    static BITMAP_KERNEL kernel;
+    uint32_t words = count / 32, tail = count % 32;
+    uint32_t j, value, bad_range = max_bad - min_bad;
+
+    if (!kernel)
+	kernel = select_kernel();
+    kernel(fat, words, mask, min_bad, bad_range, free_map, bad_map, run_map);
+
+    /* The entries past the last full word must not be read in blocks */
+    if (tail) {
+	fat += words * 32;
+	free_map[words] = bad_map[words] = run_map[words] = 0;
+	for (j = 0; j < tail; j++) {
+	    value = fat[j] & mask;
+	    free_map[words] |= (uint32_t)(value == 0) << j;
+	    bad_map[words] |= (uint32_t)(value - min_bad <= bad_range) << j;
+	    run_map[words] |= (uint32_t)(value == words * 32 + j + 1) << j;
+	}
+    }
+}
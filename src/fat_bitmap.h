@@ -0,0 +1,36 @@
+/* fat_bitmap.h - Classify the whole FAT into free and bad cluster bitmaps
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+   The complete text of the GNU General Public License
+   can be found in /usr/share/common-licenses/GPL-3 file.
+*/
+
+#ifndef _FAT_BITMAP_H
+#define _FAT_BITMAP_H
+
+#include <stdint.h>
+
+void build_fat_bitmap(const uint32_t *fat, uint32_t count, uint32_t mask,
+		      uint32_t min_bad, uint32_t max_bad,
+		      uint32_t *free_map, uint32_t *bad_map, uint32_t *run_map);
+
+/* Classifies the decoded FAT entries 0 up to COUNT - 1 in one sweep. Bit
+   N % 32 of FREE_MAP[N / 32] is set if entry N, masked with MASK, is zero,
+   the same bit of BAD_MAP if it is between MIN_BAD and MAX_BAD, and the same
+   bit of RUN_MAP if it is N + 1. Entries with neither of the first two bits
+   set are in use. All maps have (COUNT + 31) / 32 words; the bits past COUNT
+   are cleared. The sweep uses the widest vector unit the CPU has. */
+
+#endif
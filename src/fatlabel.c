@@ -48,6 +48,7 @@
 
 int rw = 0, list = 0, test = 0, verbose = 0, no_spaces_in_sfns = 0;
 long fat_table = 0;
+int flush_interval = 1;
 unsigned n_files = 0;
 void *mem_queue = NULL;
 
@@ -41,13 +41,18 @@
 #include "common.h"
 #include "fsck.fat.h"
 #include "io.h"
+#include "io_backend.h"
 #include "boot.h"
 #include "fat.h"
 #include "file.h"
 #include "check.h"
 #include "charconv.h"
+#include "readahead.h"
 
 int rw = 0, list = 0, test = 0, verbose = 0;
+int prefetch = 16;
+int flush_interval = 1;
+int jobs = 1;
 long fat_table = 0;
 int no_spaces_in_sfns = 0;
 int only_uppercase_label = 0;
@@ -75,12 +80,21 @@ static void usage(char *name, int exitval)
     fprintf(stderr, "  -b              make read-only boot sector check\n");
     fprintf(stderr, "  -c N            use DOS codepage N to decode short file names (default: %d)\n",
 	    DEFAULT_DOS_CODEPAGE);
+    fprintf(stderr, "  --cache-size=N  use N MiB of memory to cache small reads (default: 8)\n");
     fprintf(stderr, "  -d PATH         drop file with name PATH (can be given multiple times)\n");
     fprintf(stderr, "  -f              salvage unused chains to files\n");
     fprintf(stderr, "  -F NUM          specify FAT table NUM used for filesystem access\n");
+    fprintf(stderr, "  --flush-interval=N  with -w, write the FAT once N sectors of it changed\n");
+    fprintf(stderr, "                    (default: 1)\n");
+    fprintf(stderr, "  --io=NAME       use I/O backend NAME: auto (default), %s\n",
+	    io_backends());
+    fprintf(stderr, "  -j N            with -n, read directories ahead in N - 1 extra threads\n");
+    fprintf(stderr, "                    (default: 1)\n");
     fprintf(stderr, "  -l              list path names\n");
+    fprintf(stderr, "  --max-memory=N  keep at most N MiB of pending changes in memory\n");
     fprintf(stderr, "  -n              no-op, check non-interactively without changing\n");
     fprintf(stderr, "  -p              same as -a, for compat with other *fsck\n");
+    fprintf(stderr, "  --prefetch=N    read up to N directory clusters ahead (default: 16)\n");
     fprintf(stderr, "  -r              interactively repair the filesystem (default)\n");
     fprintf(stderr, "  -S              disallow spaces in the middle of short file names\n");
     fprintf(stderr, "  -t              test for bad clusters\n");
@@ -100,15 +114,23 @@ int main(int argc, char **argv)
 {
     DOS_FS fs;
     int salvage_files, verify, c;
+    unsigned files;
     uint32_t free_clusters = 0;
     struct termios tio;
     char *tmp;
-    long codepage = -1;
+    long codepage = -1, number;
+    unsigned long cache_size, max_memory;
 
-    enum {OPT_HELP=1000, OPT_VARIANT};
+    enum {OPT_HELP=1000, OPT_VARIANT, OPT_CACHE_SIZE, OPT_IO, OPT_PREFETCH,
+	  OPT_MAX_MEMORY, OPT_FLUSH_INTERVAL};
     const struct option long_options[] = {
-	    {"variant", required_argument, NULL, OPT_VARIANT},
-	    {"help",    no_argument,       NULL, OPT_HELP},
+	    {"variant",    required_argument, NULL, OPT_VARIANT},
+	    {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+	    {"io",         required_argument, NULL, OPT_IO},
+	    {"prefetch",   required_argument, NULL, OPT_PREFETCH},
+	    {"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+	    {"flush-interval", required_argument, NULL, OPT_FLUSH_INTERVAL},
+	    {"help",       no_argument,       NULL, OPT_HELP},
 	    {0,}
     };
 
@@ -126,7 +148,7 @@ int main(int argc, char **argv)
 
     printf("fsck.fat " VERSION " (" VERSION_DATE ")\n");
 
-    while ((c = getopt_long(argc, argv, "Aac:d:bfF:lnprStu:UvVwy",
+    while ((c = getopt_long(argc, argv, "Aac:d:bfF:j:lnprStu:UvVwy",
 				    long_options, NULL)) != -1)
 	switch (c) {
 	case 'A':		/* toggle Atari format */
@@ -166,6 +188,16 @@ int main(int argc, char **argv)
 		usage(argv[0], 2);
 	    }
 	    break;
+	case 'j':
+	    errno = 0;
+	    number = strtol(optarg, &tmp, 10);
+	    if (!*optarg || !isdigit((unsigned char)*optarg) || *tmp || errno ||
+		number < 1 || number > READAHEAD_MAX_THREADS) {
+		fprintf(stderr, "Invalid number of jobs : %s\n", optarg);
+		usage(argv[0], 2);
+	    }
+	    jobs = number;
+	    break;
 	case 'l':
 	    list = 1;
 	    break;
@@ -208,6 +240,52 @@ int main(int argc, char **argv)
 	case 'w':
 	    write_immed = 1;
 	    break;
+	case OPT_CACHE_SIZE:
+	    errno = 0;
+	    cache_size = strtoul(optarg, &tmp, 10);
+	    if (!*optarg || !isdigit((unsigned char)*optarg) || *tmp || errno ||
+		cache_size > SIZE_MAX / (1024 * 1024)) {
+		fprintf(stderr, "Invalid cache size : %s\n", optarg);
+		usage(argv[0], 2);
+	    }
+	    fs_cache_size(cache_size * 1024 * 1024);
+	    break;
+	case OPT_MAX_MEMORY:
+	    errno = 0;
+	    max_memory = strtoul(optarg, &tmp, 10);
+	    if (!*optarg || !isdigit((unsigned char)*optarg) || *tmp || errno ||
+		max_memory > SIZE_MAX / (1024 * 1024)) {
+		fprintf(stderr, "Invalid memory limit : %s\n", optarg);
+		usage(argv[0], 2);
+	    }
+	    fs_max_memory(max_memory * 1024 * 1024);
+	    break;
+	case OPT_PREFETCH:
+	    errno = 0;
+	    number = strtol(optarg, &tmp, 10);
+	    if (!*optarg || !isdigit((unsigned char)*optarg) || *tmp || errno ||
+		number < 0 || number > PREFETCH_MAX) {
+		fprintf(stderr, "Invalid prefetch depth : %s\n", optarg);
+		usage(argv[0], 2);
+	    }
+	    prefetch = number;
+	    break;
+	case OPT_FLUSH_INTERVAL:
+	    errno = 0;
+	    number = strtol(optarg, &tmp, 10);
+	    if (!*optarg || !isdigit((unsigned char)*optarg) || *tmp || errno ||
+		number < 1 || number > INT_MAX) {
+		fprintf(stderr, "Invalid flush interval : %s\n", optarg);
+		usage(argv[0], 2);
+	    }
+	    flush_interval = number;
+	    break;
+	case OPT_IO:
+	    if (io_select(optarg) < 0) {
+		fprintf(stderr, "Unknown I/O backend: %s\n", optarg);
+		usage(argv[0], 2);
+	    }
+	    break;
 	case OPT_HELP:
 	    usage(argv[0], 0);
 	    break;
@@ -225,6 +303,14 @@ int main(int argc, char **argv)
 	fprintf(stderr, "-t and -w can not be used in read only mode\n");
 	exit(2);
     }
+    if (jobs > 1 && rw) {
+	fprintf(stderr, "-j can only be used in read only mode\n");
+	exit(2);
+    }
+    if (jobs > 1 && !readahead_supported()) {
+	fprintf(stderr, "-j needs threads, which this build does not support\n");
+	exit(2);
+    }
     if (optind != argc - 1)
 	usage(argv[0], 2);
 
@@ -236,8 +322,13 @@ int main(int argc, char **argv)
 
     if (verify)
 	printf("Starting check/repair pass.\n");
-    while (read_fat(&fs, 2), scan_root(&fs))
-	qfree(&mem_queue);
+    /* Repairs that need parts of the tree scanned again are followed by
+     * one more check of everything, with the FAT read anew */
+    files = n_files;
+    while (read_fat(&fs, 2), scan_root(&fs)) {
+	qreset(&mem_queue);
+	n_files = files;
+    }
     check_label(&fs);
     if (test)
 	fix_bad(&fs);
@@ -165,17 +165,23 @@ typedef struct {
     unsigned int root_entries;
     off_t data_start;
     unsigned int cluster_size;
+    unsigned int sector_size;	/* logical sector size in bytes */
     uint32_t data_clusters;	/* not including two reserved cluster numbers */
     off_t fsinfo_start;		/* 0 if not present */
     long free_clusters;
+    uint32_t free_hint;		/* FSINFO next_cluster, -1 if unknown */
     off_t backupboot_start;	/* 0 if not present */
-    unsigned char *fat;
-    DOS_FILE **cluster_owner;
+    uint32_t *fat;		/* decoded, one native entry per cluster */
+    unsigned int fat_map_size;	/* 0 if fat is allocated, not mapped */
+    uint32_t *cluster_owner;	/* 2 bits of ownership per cluster */
     uint32_t serial;
     char label[11];
 } DOS_FS;
 
 extern int rw, list, verbose, test, no_spaces_in_sfns;
+extern int prefetch;		/* directory clusters to read ahead */
+extern int flush_interval;	/* dirty FAT sectors written at once with -w */
+extern int jobs;		/* threads reading directories with -n */
 extern long fat_table;
 extern int only_uppercase_label;
 extern unsigned n_files;
@@ -38,32 +38,621 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
 
 #include "fsck.fat.h"
 #include "common.h"
 #include "io.h"
+#include "io_backend.h"
 
+/* Changes closer together than this are written out as one extent */
+#define FLUSH_GAP 512
+
+/* Size of the blocks kept in the read cache */
+#define CACHE_BLOCK 4096
+/* Maximum number of blocks read in one batch */
+#define CACHE_BATCH IO_DEPTH
+
+/* Upper limit for the scratch memory used by fs_test_many() */
+#define TEST_SCRATCH (4 * 1024 * 1024)
+
+/*
+ * Pending changes are kept in a treap ordered by position. Overlapping
+ * changes are merged when they are queued, so the ranges in the tree never
+ * overlap and each dirty byte is stored only once.
+ *
+ * Once the data of the queued changes exceeds change_budget bytes, the data
+ * of further changes is moved to an unlinked temporary file and only the
+ * nodes stay in memory. Space in that file is never reused; merged changes
+ * are simply appended again.
+ */
 typedef struct _change {
-    void *data;
+    void *data;			/* NULL if the data is in the spill file */
+    off_t spill;		/* offset of the data in the spill file */
     off_t pos;
     int size;
-    struct _change *next;
+    unsigned int prio;
+    struct _change *left, *right;
 } CHANGE;
 
-static CHANGE *changes, *last;
-static int fd, did_change = 0;
+static CHANGE *changes, *change_unused;
+static void *change_queue;
+static int n_changes;
+static size_t change_budget, change_bytes;
+static int spill_fd = -1;
+static off_t spill_end;
+static struct io_dev *dev;
+static int did_change = 0;
+
+/*
+ * Small reads are served from a cache of CACHE_BLOCK sized blocks of the
+ * device, managed in least recently used order. The cache only ever holds
+ * the contents of the disk; pending changes are applied on top of it by
+ * fs_read(), just like for uncached reads.
+ */
+typedef struct _block {
+    off_t pos;
+    int valid;			/* bytes actually read, less at end of device */
+    int prefetched;		/* read ahead of time and not used yet */
+    struct _block *hash_next;
+    struct _block *prev, *next;	/* LRU list, most recently used first */
+    unsigned char data[CACHE_BLOCK];
+} BLOCK;
+
+static size_t cache_size = 8 * 1024 * 1024;
+static unsigned int cache_max, cache_blocks, cache_hash_mask;
+static BLOCK **cache_hash;
+static BLOCK *cache_head, *cache_tail;
+static unsigned long cache_hits, cache_misses, prefetch_blocks, prefetch_hits;
+
+/*
+ * A filesystem opened read-only is mapped into memory as a whole, so reads
+ * are plain copies from the page cache. A read error on a mapped page raises
+ * SIGBUS, which is turned into the usual read error message.
+ */
+static unsigned char *map;
+static off_t map_size;
+static sigjmp_buf map_fault;
+static volatile sig_atomic_t map_guard;
+
+
+static unsigned int change_prio(off_t pos)
+{
+    /* Fibonacci hashing spreads the mostly sequential positions well */
+    return (unsigned int)(((uint64_t)pos * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+/* Split TREE into the changes starting before POS and all others. */
+static void change_split(CHANGE * tree, off_t pos, CHANGE ** left,
+			 CHANGE ** right)
+{
+    if (!tree) {
+	*left = *right = NULL;
+    } else if (tree->pos < pos) {
+	change_split(tree->right, pos, &tree->right, right);
+	*left = tree;
+    } else {
+	change_split(tree->left, pos, left, &tree->left);
+	*right = tree;
+    }
+}
+
+/* Join two trees where all changes in LEFT lie before those in RIGHT. */
+static CHANGE *change_join(CHANGE * left, CHANGE * right)
+{
+    if (!left)
+	return right;
+    if (!right)
+	return left;
+    if (left->prio > right->prio) {
+	left->right = change_join(left->right, right);
+	return left;
+    }
+    right->left = change_join(left, right->left);
+    return right;
+}
+
+static void spill_open(void)
+{
+    const char *dir;
+    char *name;
+
+    if (!(dir = getenv("TMPDIR")) || !*dir)
+	dir = "/tmp";
+    name = alloc(strlen(dir) + sizeof("/fsck.fat-XXXXXX"));
+    sprintf(name, "%s/fsck.fat-XXXXXX", dir);
+    if ((spill_fd = mkstemp(name)) < 0)
+	pdie("Can't create temporary file in %s", dir);
+    unlink(name);
+    free(name);
+    spill_end = 0;
+}
+
+/* Copy SIZE bytes starting at OFFSET within the data of CHANGE into BUF. */
+static void change_load(CHANGE * change, int offset, int size, void *buf)
+{
+    if (change->data)
+	memcpy(buf, (char *)change->data + offset, size);
+    else if (pread(spill_fd, buf, size, change->spill + offset) != size)
+	pdie("Reading %d bytes from the temporary file", size);
+}
+
+/* Copy SIZE bytes from BUF into the data of CHANGE, starting at OFFSET. */
+static void change_store(CHANGE * change, int offset, int size,
+			 const void *buf)
+{
+    if (change->data)
+	memcpy((char *)change->data + offset, buf, size);
+    else if (pwrite(spill_fd, buf, size, change->spill + offset) != size)
+	pdie("Writing %d bytes to the temporary file", size);
+}
+
+/* Append DATA to the spill file as the data of CHANGE. */
+static void spill_write(CHANGE * change, const void *data)
+{
+    if (spill_fd < 0)
+	spill_open();
+    if (pwrite(spill_fd, data, change->size, spill_end) != change->size)
+	pdie("Writing %d bytes to the temporary file", change->size);
+    change->data = NULL;
+    change->spill = spill_end;
+    spill_end += change->size;
+}
+
+/* Move the data of CHANGE to the spill file if the budget is exceeded. */
+static void change_spill(CHANGE * change)
+{
+    void *data = change->data;
+
+    if (!change_budget || change_bytes <= change_budget)
+	return;
+    spill_write(change, data);
+    free(data);
+    change_bytes -= change->size;
+}
+
+/* Returns a change node, reusing the ones freed by change_release. */
+static CHANGE *change_new(void)
+{
+    CHANGE *new;
+
+    if (!(new = change_unused))
+	return qalloc(&change_queue, sizeof(CHANGE));
+    change_unused = new->left;
+    return new;
+}
+
+static void change_release(CHANGE * change)
+{
+    free(change->data);
+    change->left = change_unused;
+    change_unused = change;
+}
+
+/* Returns the change containing the byte at POS, or NULL. */
+static CHANGE *change_lookup(off_t pos)
+{
+    CHANGE *walk = changes;
+
+    while (walk) {
+	if (pos < walk->pos)
+	    walk = walk->left;
+	else if (pos >= walk->pos + walk->size)
+	    walk = walk->right;
+	else
+	    return walk;
+    }
+    return NULL;
+}
+
+/* Copy all parts of the changes in TREE that overlap the SIZE bytes starting
+ * at POS into DATA. */
+static void change_apply(CHANGE * walk, off_t pos, int size, void *data)
+{
+    while (walk) {
+	if (walk->pos >= pos + size) {
+	    walk = walk->left;
+	    continue;
+	}
+	if (walk->pos + walk->size <= pos) {
+	    walk = walk->right;
+	    continue;
+	}
+	if (walk->pos < pos)
+	    change_load(walk, pos - walk->pos,
+			min(size, walk->size - pos + walk->pos), data);
+	else
+	    change_load(walk, 0, min(walk->size, size + pos - walk->pos),
+			(char *)data + walk->pos - pos);
+	change_apply(walk->left, pos, size, data);
+	walk = walk->right;
+    }
+}
+
+/* Copy the data of all changes in TREE into BUF, which starts at START, and
+ * free them. */
+static void change_absorb(CHANGE * tree, off_t start, char *buf)
+{
+    if (!tree)
+	return;
+    change_absorb(tree->left, start, buf);
+    change_absorb(tree->right, start, buf);
+    change_load(tree, 0, tree->size, buf + (tree->pos - start));
+    if (tree->data)
+	change_bytes -= tree->size;
+    change_release(tree);
+    n_changes--;
+}
+
+static void change_insert(off_t pos, int size, void *data)
+{
+    CHANGE *left, *mid, *right, *walk, *new;
+    off_t start, end;
+
+    /* Rewriting bytes that are already queued only updates the data */
+    if ((walk = change_lookup(pos)) && pos + size <= walk->pos + walk->size) {
+	change_store(walk, pos - walk->pos, size, data);
+	return;
+    }
+
+    start = pos;
+    end = pos + size;
+    change_split(changes, pos, &left, &right);
+    /* Only the last change starting before POS can reach into the new one */
+    for (walk = left; walk && walk->right; walk = walk->right) ;
+    if (walk && walk->pos + walk->size > pos) {
+	start = walk->pos;
+	if (walk->pos + walk->size > end)
+	    end = walk->pos + walk->size;
+	change_split(left, walk->pos, &left, &mid);
+    } else
+	mid = NULL;
+    /* Changes starting inside the new one are merged into it as well */
+    change_split(right, pos + size, &walk, &right);
+    mid = change_join(mid, walk);
+    for (walk = mid; walk && walk->right; walk = walk->right) ;
+    if (walk && walk->pos + walk->size > end)
+	end = walk->pos + walk->size;
+
+    new = change_new();
+    new->pos = start;
+    new->size = end - start;
+    new->prio = change_prio(start);
+    new->left = new->right = NULL;
+    if (!mid && change_budget && change_bytes + size > change_budget) {
+	/* Nothing to merge, the data can go to the spill file directly */
+	spill_write(new, data);
+    } else {
+	new->data = alloc(new->size);
+	change_bytes += new->size;
+	change_absorb(mid, start, new->data);
+	memcpy((char *)new->data + (pos - start), data, size);
+	change_spill(new);
+    }
+    changes = change_join(change_join(left, new), right);
+    n_changes++;
+}
+
+/* Free the data of all changes in TREE. The nodes are freed along with
+ * change_queue. */
+static void change_free(CHANGE * tree)
+{
+    if (!tree)
+	return;
+    change_free(tree->left);
+    change_free(tree->right);
+    free(tree->data);
+}
+
+/* Store the changes in TREE into LIST in ascending order of position. */
+static void change_list(CHANGE * tree, CHANGE ** list, int *n)
+{
+    if (!tree)
+	return;
+    change_list(tree->left, list, n);
+    list[(*n)++] = tree;
+    change_list(tree->right, list, n);
+}
+
+static BLOCK **cache_slot(off_t pos)
+{
+    return &cache_hash[((uint64_t)(pos / CACHE_BLOCK) * 0x9e3779b97f4a7c15ULL
+			>> 32) & cache_hash_mask];
+}
+
+static void cache_unlink(BLOCK * block)
+{
+    if (block->prev)
+	block->prev->next = block->next;
+    else
+	cache_head = block->next;
+    if (block->next)
+	block->next->prev = block->prev;
+    else
+	cache_tail = block->prev;
+}
+
+static void cache_link(BLOCK * block)
+{
+    block->prev = NULL;
+    block->next = cache_head;
+    if (cache_head)
+	cache_head->prev = block;
+    else
+	cache_tail = block;
+    cache_head = block;
+}
 
+/* Returns the cached block starting at POS, or NULL. */
+static BLOCK *cache_find(off_t pos)
+{
+    BLOCK *walk;
+
+    for (walk = *cache_slot(pos); walk; walk = walk->hash_next)
+	if (walk->pos == pos)
+	    return walk;
+    return NULL;
+}
+
+/* Returns an unused block, evicting the least recently used one if the cache
+ * is full. */
+static BLOCK *cache_get(void)
+{
+    BLOCK *block, **walk;
+
+    if (cache_blocks < cache_max) {
+	cache_blocks++;
+	return alloc(sizeof(BLOCK));
+    }
+    block = cache_tail;
+    cache_unlink(block);
+    for (walk = cache_slot(block->pos); *walk != block;
+	 walk = &(*walk)->hash_next) ;
+    *walk = block->hash_next;
+    return block;
+}
+
+/* Read a run of uncached blocks, starting with the one at POS and ending
+ * before END or at the next cached block. Returns the block at POS. */
+static BLOCK *cache_fill(off_t pos, off_t end)
+{
+    BLOCK *blocks[CACHE_BATCH], **slot;
+    struct io_request req[CACHE_BATCH];
+    int i, n;
+
+    n = 0;
+    do {
+	blocks[n] = cache_get();
+	blocks[n]->pos = pos + (off_t)n * CACHE_BLOCK;
+	req[n].pos = blocks[n]->pos;
+	req[n].data = blocks[n]->data;
+	req[n].size = CACHE_BLOCK;
+	req[n].write = 0;
+	n++;
+    } while (n < CACHE_BATCH && pos + (off_t)n * CACHE_BLOCK < end &&
+	     !cache_find(pos + (off_t)n * CACHE_BLOCK));
+
+    io_submit(dev, req, n);
+    for (i = 0; i < n; i++)
+	if (req[i].result < 0) {
+	    errno = -req[i].result;
+	    pdie("Read %d bytes at %lld", n * CACHE_BLOCK, (long long)pos);
+	}
+
+    for (i = n - 1; i >= 0; i--) {
+	blocks[i]->valid = req[i].result;
+	blocks[i]->prefetched = 0;
+	slot = cache_slot(blocks[i]->pos);
+	blocks[i]->hash_next = *slot;
+	*slot = blocks[i];
+	cache_link(blocks[i]);
+    }
+    return blocks[0];
+}
+
+static void cache_read(off_t pos, int size, void *data)
+{
+    BLOCK *block;
+    off_t walk, from, to;
+
+    for (walk = pos - pos % CACHE_BLOCK; walk < pos + size;
+	 walk += CACHE_BLOCK) {
+	if ((block = cache_find(walk))) {
+	    cache_hits++;
+	    if (block->prefetched) {
+		prefetch_hits++;
+		block->prefetched = 0;
+	    }
+	    cache_unlink(block);
+	    cache_link(block);
+	} else {
+	    cache_misses++;
+	    block = cache_fill(walk, pos + size);
+	}
+	from = walk < pos ? pos : walk;
+	to = walk + CACHE_BLOCK < pos + size ? walk + CACHE_BLOCK : pos + size;
+	if (to > walk + block->valid)
+	    die("Got %d bytes instead of %d at %lld",
+		walk + block->valid > pos ? (int)(walk + block->valid - pos) : 0,
+		size, (long long)pos);
+	memcpy((char *)data + (from - pos), block->data + (from - walk),
+	       to - from);
+    }
+}
+
+/* Update cached blocks after SIZE bytes at POS have been written to disk. */
+static void cache_update(off_t pos, int size, void *data)
+{
+    BLOCK *block;
+    off_t walk, from, to;
+
+    if (!cache_hash)
+	return;
+    for (walk = pos - pos % CACHE_BLOCK; walk < pos + size;
+	 walk += CACHE_BLOCK) {
+	if (!(block = cache_find(walk)))
+	    continue;
+	from = walk < pos ? pos : walk;
+	to = walk + block->valid < pos + size ? walk + block->valid : pos + size;
+	if (from < to)
+	    memcpy(block->data + (from - walk), (char *)data + (from - pos),
+		   to - from);
+    }
+}
+
+/* Remove BLOCK from the cache. */
+static void cache_drop(BLOCK * block)
+{
+    BLOCK **walk;
+
+    cache_unlink(block);
+    for (walk = cache_slot(block->pos); *walk != block;
+	 walk = &(*walk)->hash_next) ;
+    *walk = block->hash_next;
+    free(block);
+    cache_blocks--;
+}
+
+static void cache_free(void)
+{
+    BLOCK *next;
+
+    while (cache_head) {
+	next = cache_head->next;
+	free(cache_head);
+	cache_head = next;
+    }
+    cache_tail = NULL;
+    free(cache_hash);
+    cache_hash = NULL;
+    cache_blocks = 0;
+    if (verbose && cache_hits + cache_misses)
+	printf("Read cache: %lu hits, %lu misses, %lu of %lu prefetched "
+	       "blocks used.\n", cache_hits, cache_misses, prefetch_hits,
+	       prefetch_blocks);
+    cache_hits = cache_misses = prefetch_blocks = prefetch_hits = 0;
+}
+
+void fs_max_memory(size_t size)
+{
+    change_budget = size;
+}
+
+void fs_cache_size(size_t size)
+{
+    cache_size = size;
+}
+
+static void map_sigbus(int sig)
+{
+    static const char msg[] = "Read error in memory mapped filesystem\n";
+
+    (void)sig;
+    if (map_guard)
+	siglongjmp(map_fault, 1);
+    if (write(2, msg, sizeof(msg) - 1) < 0) {
+	/* nothing left to do */
+    }
+    _exit(1);
+}
+
+static void map_open(void)
+{
+    struct stat st;
+    struct sigaction sa;
+
+    if (fstat(dev->fd, &st) < 0)
+	return;
+    if (S_ISREG(st.st_mode))
+	map_size = st.st_size;
+    else if (S_ISBLK(st.st_mode))
+	map_size = lseek(dev->fd, 0, SEEK_END);
+    else
+	return;
+    if (map_size <= 0 || (off_t)(size_t)map_size != map_size)
+	return;
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, dev->fd, 0);
+    if (map == MAP_FAILED) {
+	map = NULL;
+	return;
+    }
+    /* The directory tree is visited in no particular order */
+    posix_madvise(map, map_size, POSIX_MADV_RANDOM);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = map_sigbus;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+static void map_close(void)
+{
+    if (map)
+	munmap(map, map_size);
+    map = NULL;
+}
+
+void *fs_map(off_t pos, int size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    off_t delta = pos % page;
+    unsigned char *data;
+
+    if (!map || pos + size > map_size)
+	return NULL;
+    data = mmap(NULL, size + delta, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		dev->fd, pos - delta);
+    if (data == MAP_FAILED)
+	return NULL;
+    posix_madvise(data, size + delta, POSIX_MADV_SEQUENTIAL);
+    change_apply(changes, pos, size, data + delta);
+    return data + delta;
+}
+
+void fs_map_random(void *data, int size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t delta = (uintptr_t)data % page;
+
+    posix_madvise((char *)data - delta, size + delta, POSIX_MADV_RANDOM);
+}
+
+void fs_unmap(void *data, int size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t delta = (uintptr_t)data % page;
+
+    munmap((char *)data - delta, size + delta);
+}
 
 void fs_open(const char *path, int rw)
 {
+    int fd;
+
     if ((fd = open(path, rw ? O_RDWR : O_RDONLY)) < 0) {
 	perror("open");
 	exit(6);
     }
-    changes = last = NULL;
+    dev = io_attach(fd);
+    changes = NULL;
+    n_changes = 0;
     did_change = 0;
+
+    if (!rw)
+	map_open();
+
+    cache_max = map ? 0 : cache_size / sizeof(BLOCK);
+    if (cache_max >= 8) {
+	for (cache_hash_mask = 1; cache_hash_mask < cache_max;
+	     cache_hash_mask <<= 1) ;
+	cache_hash = alloc(cache_hash_mask * sizeof(BLOCK *));
+	memset(cache_hash, 0, cache_hash_mask * sizeof(BLOCK *));
+	cache_hash_mask--;
+    }
 }
 
 /**
@@ -77,25 +666,103 @@ void fs_open(const char *path, int rw)
  */
 void fs_read(off_t pos, int size, void *data)
 {
-    CHANGE *walk;
     int got;
 
-    if (lseek(fd, pos, 0) != pos)
-	pdie("Seek to %lld", (long long)pos);
-    if ((got = read(fd, data, size)) < 0)
-	pdie("Read %d bytes at %lld", size, (long long)pos);
-    if (got != size)
-	die("Got %d bytes instead of %d at %lld", got, size, (long long)pos);
-    for (walk = changes; walk; walk = walk->next) {
-	if (walk->pos < pos + size && walk->pos + walk->size > pos) {
-	    if (walk->pos < pos)
-		memcpy(data, (char *)walk->data + pos - walk->pos,
-		       min(size, walk->size - pos + walk->pos));
-	    else
-		memcpy((char *)data + walk->pos - pos, walk->data,
-		       min(walk->size, size + pos - walk->pos));
+    if (map && pos + size <= map_size) {
+	if (sigsetjmp(map_fault, 0)) {
+	    map_guard = 0;
+	    errno = EIO;
+	    pdie("Read %d bytes at %lld", size, (long long)pos);
 	}
+	map_guard = 1;
+	memcpy(data, map + pos, size);
+	map_guard = 0;
+    } else if (cache_hash && size <= cache_max / 4 * CACHE_BLOCK) {
+	/* Large reads like whole FATs would only flush the cache */
+	cache_read(pos, size, data);
+    } else {
+	if ((got = io_read(dev, data, size, pos)) < 0)
+	    pdie("Read %d bytes at %lld", size, (long long)pos);
+	if (got != size)
+	    die("Got %d bytes instead of %d at %lld", got, size,
+		(long long)pos);
     }
+    change_apply(changes, pos, size, data);
+}
+
+int fs_read_shared(off_t pos, int size, void *data)
+{
+    int got;
+
+    /* Plain pread() keeps the statistics of the backend out of it, and
+     * looking up the changes leaves them as they are */
+    if ((got = pread(dev->fd, data, size, pos)) > 0)
+	change_apply(changes, pos, got, data);
+    return got;
+}
+
+void fs_prefetch(const off_t * pos, int n, int size)
+{
+    BLOCK **blocks, **slot;
+    struct io_request *req;
+    off_t walk;
+    int i, count, max;
+
+    if (map) {
+	for (i = 0; i < n; i++)
+	    if (pos[i] + size <= map_size)
+		posix_madvise(map + pos[i] - pos[i] % sysconf(_SC_PAGESIZE),
+			      size + pos[i] % sysconf(_SC_PAGESIZE),
+			      POSIX_MADV_WILLNEED);
+	return;
+    }
+    if (!cache_hash) {
+	for (i = 0; i < n; i++)
+	    posix_fadvise(dev->fd, pos[i], size, POSIX_FADV_WILLNEED);
+	return;
+    }
+
+    /*
+     * Read all missing blocks in one batch. The blocks are entered into the
+     * cache before they are read, which keeps blocks shared by several areas
+     * from being read twice. Only a fraction of the cache is used, so no
+     * block of the batch is evicted by a later one.
+     */
+    max = cache_max / 4;
+    blocks = alloc(max * sizeof(BLOCK *));
+    req = alloc(max * sizeof(struct io_request));
+    count = 0;
+    for (i = 0; i < n; i++)
+	for (walk = pos[i] - pos[i] % CACHE_BLOCK;
+	     walk < pos[i] + size && count < max; walk += CACHE_BLOCK) {
+	    if (cache_find(walk))
+		continue;
+	    blocks[count] = cache_get();
+	    blocks[count]->pos = walk;
+	    blocks[count]->valid = 0;
+	    blocks[count]->prefetched = 1;
+	    slot = cache_slot(walk);
+	    blocks[count]->hash_next = *slot;
+	    *slot = blocks[count];
+	    cache_link(blocks[count]);
+	    req[count].pos = walk;
+	    req[count].data = blocks[count]->data;
+	    req[count].size = CACHE_BLOCK;
+	    req[count].write = 0;
+	    count++;
+	}
+    io_submit(dev, req, count);
+    for (i = 0; i < count; i++) {
+	/* Leave errors to be reported by the actual read */
+	if (req[i].result <= 0)
+	    cache_drop(blocks[i]);
+	else {
+	    blocks[i]->valid = req[i].result;
+	    prefetch_blocks++;
+	}
+    }
+    free(req);
+    free(blocks);
 }
 
 int fs_test(off_t pos, int size)
@@ -103,78 +770,209 @@ int fs_test(off_t pos, int size)
     void *scratch;
     int okay;
 
-    if (lseek(fd, pos, 0) != pos)
-	pdie("Seek to %lld", (long long)pos);
     scratch = alloc(size);
-    okay = read(fd, scratch, size) == size;
+    okay = io_read(dev, scratch, size, pos) == size;
     free(scratch);
     return okay;
 }
 
+void fs_test_many(const off_t * pos, int n, int size, int *okay)
+{
+    struct io_request req[IO_DEPTH];
+    char *scratch;
+    int batch, i, j;
+
+    batch = TEST_SCRATCH / size;
+    if (batch > IO_DEPTH)
+	batch = IO_DEPTH;
+    if (batch < 1)
+	batch = 1;
+    scratch = alloc(batch * size);
+    for (i = 0; i < n; i += batch) {
+	for (j = 0; j < batch && i + j < n; j++) {
+	    req[j].pos = pos[i + j];
+	    req[j].data = scratch + j * size;
+	    req[j].size = size;
+	    req[j].write = 0;
+	}
+	io_submit(dev, req, j);
+	for (j = 0; j < batch && i + j < n; j++)
+	    okay[i + j] = req[j].result == size;
+    }
+    free(scratch);
+}
+
 void fs_write(off_t pos, int size, void *data)
 {
-    CHANGE *new;
     int did;
 
     if (write_immed) {
 	did_change = 1;
-	if (lseek(fd, pos, 0) != pos)
-	    pdie("Seek to %lld", (long long)pos);
-	if ((did = write(fd, data, size)) == size)
+	if ((did = io_write(dev, data, size, pos)) == size) {
+	    cache_update(pos, size, data);
 	    return;
+	}
 	if (did < 0)
 	    pdie("Write %d bytes at %lld", size, (long long)pos);
 	die("Wrote %d bytes instead of %d at %lld", did, size, (long long)pos);
     }
-    new = alloc(sizeof(CHANGE));
-    new->pos = pos;
-    memcpy(new->data = alloc(new->size = size), data, size);
-    new->next = NULL;
-    if (last)
-	last->next = new;
-    else
-	changes = new;
-    last = new;
+    if (size > 0)
+	change_insert(pos, size, data);
 }
 
-static void fs_flush(void)
+/**
+ * Turn N changes that lie less than FLUSH_GAP bytes apart from each other
+ * into write requests.
+ *
+ * If the changes are separated by several gaps, the gaps are filled with the
+ * current contents of the disk, so the whole extent takes one read and one
+ * write. Otherwise each change gets its own request and the backend merges
+ * the adjacent ones.
+ *
+ * @param[in]   list    Changes in ascending order of position
+ * @param[in]   n       Number of changes
+ * @param[out]  req     Where to put the requests, room for N of them
+ * @param[out]  fill    Buffers to free after writing each request, or NULL
+ *
+ * @return  Number of requests stored in REQ
+ */
+static int flush_extent(CHANGE ** list, int n, struct io_request *req,
+			char **fill)
 {
-    CHANGE *this;
-    int size;
+    off_t start, end;
+    int i, gaps;
+    char *buf;
+
+    start = list[0]->pos;
+    end = list[n - 1]->pos + list[n - 1]->size;
+    for (gaps = 0, i = 1; i < n; i++)
+	if (list[i]->pos != list[i - 1]->pos + list[i - 1]->size)
+	    gaps++;
+    if (gaps > 1) {
+	buf = alloc(end - start);
+	if (io_read(dev, buf, end - start, start) == end - start) {
+	    for (i = 0; i < n; i++)
+		change_load(list[i], 0, list[i]->size,
+			    buf + (list[i]->pos - start));
+	    req->pos = start;
+	    req->data = buf;
+	    req->size = end - start;
+	    req->write = 1;
+	    *fill = buf;
+	    return 1;
+	}
+	/* Could not read the gaps, write the changes on their own */
+	free(buf);
+    }
+
+    for (i = 0; i < n; i++) {
+	fill[i] = NULL;
+	if (!list[i]->data) {
+	    fill[i] = alloc(list[i]->size);
+	    change_load(list[i], 0, list[i]->size, fill[i]);
+	}
+	req[i].pos = list[i]->pos;
+	req[i].data = fill[i] ? fill[i] : list[i]->data;
+	req[i].size = list[i]->size;
+	req[i].write = 1;
+    }
+    return n;
+}
+
+/* Submit the COUNT write requests in REQ, report the failed ones, free the
+ * buffers in FILL and return the number of bytes written. */
+static unsigned long long flush_submit(struct io_request *req, char **fill,
+				       int count)
+{
+    unsigned long long bytes;
+    int i;
 
-    while (changes) {
-	this = changes;
-	changes = changes->next;
-	if (lseek(fd, this->pos, 0) != this->pos)
-	    fprintf(stderr,
-		    "Seek to %lld failed: %s\n  Did not write %d bytes.\n",
-		    (long long)this->pos, strerror(errno), this->size);
-	else if ((size = write(fd, this->data, this->size)) < 0)
-	    fprintf(stderr, "Writing %d bytes at %lld failed: %s\n", this->size,
-		    (long long)this->pos, strerror(errno));
-	else if (size != this->size)
+    io_submit(dev, req, count);
+    for (bytes = 0, i = 0; i < count; i++) {
+	free(fill[i]);
+	if (req[i].result < 0) {
+	    fprintf(stderr, "Writing %d bytes at %lld failed: %s\n",
+		    (int)req[i].size, (long long)req[i].pos,
+		    strerror(-req[i].result));
+	    continue;
+	}
+	bytes += req[i].result;
+	if (req[i].result != req[i].size)
 	    fprintf(stderr, "Wrote %d bytes instead of %d bytes at %lld."
-		    "\n", size, this->size, (long long)this->pos);
-	free(this->data);
-	free(this);
+		    "\n", (int)req[i].result, (int)req[i].size,
+		    (long long)req[i].pos);
     }
+    return bytes;
+}
+
+/* Write out all pending changes in ascending order of position, coalescing
+ * neighbouring changes into larger writes. The requests are submitted all at
+ * once, unless the buffers they need would exceed the memory budget. */
+static void fs_flush(void)
+{
+    CHANGE **list;
+    struct io_request *req;
+    char **fill;
+    unsigned long calls;
+    unsigned long long bytes;
+    size_t filled;
+    int i, j, n, first, count, added;
+
+    if (!changes)
+	return;
+    list = alloc(n_changes * sizeof(CHANGE *));
+    req = alloc(n_changes * sizeof(struct io_request));
+    fill = alloc(n_changes * sizeof(char *));
+    n = 0;
+    change_list(changes, list, &n);
+    calls = dev->calls;
+    bytes = 0;
+    filled = 0;
+    for (first = count = 0, i = 1; i <= n; i++)
+	if (i == n ||
+	    list[i]->pos - (list[i - 1]->pos + list[i - 1]->size) >= FLUSH_GAP) {
+	    added = flush_extent(list + first, i - first, req + count,
+				 fill + count);
+	    for (j = count; j < count + added; j++)
+		if (fill[j])
+		    filled += req[j].size;
+	    count += added;
+	    first = i;
+	    if (change_budget && filled > change_budget) {
+		bytes += flush_submit(req, fill, count);
+		count = 0;
+		filled = 0;
+	    }
+	}
+    bytes += flush_submit(req, fill, count);
+
+    free(fill);
+    free(req);
+    free(list);
+    if (verbose)
+	printf("Wrote %llu bytes for %d changes in %lu system calls.\n",
+	       bytes, n, dev->calls - calls);
 }
 
 int fs_close(int write)
 {
-    CHANGE *next;
-    int changed;
+    int changed, fd;
 
     changed = ! !changes;
     if (write)
 	fs_flush();
-    else
-	while (changes) {
-	    next = changes->next;
-	    free(changes->data);
-	    free(changes);
-	    changes = next;
-	}
+    change_free(changes);
+    changes = change_unused = NULL;
+    qfree(&change_queue);
+    change_bytes = 0;
+    if (spill_fd >= 0)
+	close(spill_fd);
+    spill_fd = -1;
+    cache_free();
+    map_close();
+    fd = dev->fd;
+    io_detach(dev);
+    dev = NULL;
     if (close(fd) < 0)
 	pdie("closing filesystem");
     return changed || did_change;
@@ -28,6 +28,18 @@
 #define _IO_H
 
 #include <fcntl.h>		/* for off_t */
+#include <stddef.h>		/* for size_t */
+
+void fs_cache_size(size_t size);
+
+/* Sets the amount of memory used to cache small reads from the filesystem to
+   SIZE bytes. Must be called before fs_open. Zero disables the cache. */
+
+void fs_max_memory(size_t size);
+
+/* Limits the memory used for the data of queued changes to SIZE bytes. The
+   data of changes queued beyond that is kept in a temporary file. Zero, the
+   default, means no limit. */
 
 void fs_open(const char *path, int rw);
 
@@ -39,16 +51,52 @@ void fs_read(off_t pos, int size, void *data);
 /* Reads SIZE bytes starting at POS into DATA. Performs all applicable
    changes. */
 
+void fs_prefetch(const off_t * pos, int n, int size);
+
+/* Starts reading the N areas of SIZE bytes at the offsets in POS, which are
+   going to be read soon. Where possible, the areas are read into the cache in
+   parallel. Read errors are ignored and reported when the data is actually
+   read. */
+
+int fs_read_shared(off_t pos, int size, void *data);
+
+/* Reads up to SIZE bytes starting at POS into DATA like fs_read(), but
+   without the cache. Returns the number of bytes read, or -1 on errors.
+   Unlike the other functions, it may be called from several threads at the
+   same time, as long as nothing is written meanwhile. */
+
+void *fs_map(off_t pos, int size);
+
+/* Maps SIZE bytes starting at POS into memory, with all applicable changes
+   performed, and returns a pointer to them. The mapping is private, so
+   modifying the data does not change the filesystem. Returns NULL if the
+   filesystem is not opened read-only or can not be mapped. The data is
+   expected to be accessed sequentially. */
+
+void fs_map_random(void *data, int size);
+
+/* Tells the system that the mapped DATA is from now on accessed randomly. */
+
+void fs_unmap(void *data, int size);
+
+/* Removes a mapping created by fs_map. */
+
 int fs_test(off_t pos, int size);
 
 /* Returns a non-zero integer if SIZE bytes starting at POS can be read without
    errors. Otherwise, it returns zero. */
 
+void fs_test_many(const off_t * pos, int n, int size, int *okay);
+
+/* Like fs_test for the N areas of SIZE bytes starting at the offsets in POS,
+   which are read in parallel where the I/O backend allows it. The result for
+   each area is stored in the corresponding element of OKAY. */
+
 void fs_write(off_t pos, int size, void *data);
 
 /* If write_immed is non-zero, SIZE bytes are written from DATA to the disk,
-   starting at POS. If write_immed is zero, the change is added to a list in
-   memory. */
+   starting at POS. If write_immed is zero, the change is queued in memory,
+   replacing any data queued earlier for the same bytes. */
 
 int fs_close(int write);
 
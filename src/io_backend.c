@@ -0,0 +1,426 @@
+/* io_backend.c - Device access backends
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+   The complete text of the GNU General Public License
+   can be found in /usr/share/common-licenses/GPL-3 file.
+*/
+
+/*
+ * All programs access the device through a backend, which is selected once
+ * at runtime. Single reads and writes always map to pread() and pwrite(), so
+ * they may be issued from several threads. Batches of requests given to
+ * io_submit() are where the backends differ: the POSIX backend merges
+ * neighbouring requests into vectored calls, the io_uring backend keeps up
+ * to IO_DEPTH of them in flight at once.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "common.h"
+#include "io_backend.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+    defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#endif
+
+
+static int posix_open(struct io_dev *dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static ssize_t posix_read(struct io_dev *dev, void *data, size_t size,
+			  off_t pos)
+{
+    return pread(dev->fd, data, size, pos);
+}
+
+static ssize_t posix_write(struct io_dev *dev, const void *data, size_t size,
+			   off_t pos)
+{
+    return pwrite(dev->fd, data, size, pos);
+}
+
+/* Transfers the N requests in REQ, which are adjacent on disk and of the same
+ * kind, with a single call. */
+static void posix_vector(struct io_dev *dev, struct io_request *req, int n)
+{
+    struct iovec iov[IO_DEPTH];
+    ssize_t did;
+    int i;
+
+    if (n == 1) {
+	if (req->write)
+	    did = pwrite(dev->fd, req->data, req->size, req->pos);
+	else
+	    did = pread(dev->fd, req->data, req->size, req->pos);
+	dev->calls++;
+	req->result = did < 0 ? -errno : did;
+	return;
+    }
+
+    for (i = 0; i < n; i++) {
+	iov[i].iov_base = req[i].data;
+	iov[i].iov_len = req[i].size;
+    }
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+    if (req->write)
+	did = pwritev(dev->fd, iov, n, req->pos);
+    else
+	did = preadv(dev->fd, iov, n, req->pos);
+#else
+    if (lseek(dev->fd, req->pos, SEEK_SET) != req->pos)
+	did = -1;
+    else if (req->write)
+	did = writev(dev->fd, iov, n);
+    else
+	did = readv(dev->fd, iov, n);
+#endif
+    dev->calls++;
+
+    if (did < 0) {
+	/* Find out which of the requests actually failed */
+	for (i = 0; i < n; i++)
+	    posix_vector(dev, req + i, 1);
+	return;
+    }
+    for (i = 0; i < n; i++) {
+	req[i].result = (size_t)did < req[i].size ? did : (ssize_t)req[i].size;
+	did -= req[i].result;
+    }
+}
+
+static void posix_submit(struct io_dev *dev, struct io_request *req, int n)
+{
+    int first, i;
+
+    for (first = 0, i = 1; i <= n; i++)
+	if (i == n || i - first == IO_DEPTH ||
+	    req[i].write != req[i - 1].write ||
+	    req[i].pos != req[i - 1].pos + (off_t)req[i - 1].size) {
+	    posix_vector(dev, req + first, i - first);
+	    first = i;
+	}
+}
+
+static int posix_flush(struct io_dev *dev)
+{
+    return fsync(dev->fd);
+}
+
+static void posix_close(struct io_dev *dev)
+{
+    (void)dev;
+}
+
+static const struct io_backend posix_backend = {
+    "posix", posix_open, posix_read, posix_write, posix_submit,
+    posix_flush, posix_close
+};
+
+
+#ifdef USE_IO_URING
+
+/*
+ * A minimal io_uring client using the raw system calls, so that no extra
+ * library is needed. Only vectored reads and writes are used, which every
+ * kernel with io_uring support provides.
+ */
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+static void uring_unmap(struct uring *ring)
+{
+    if (ring->sqes)
+	munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+	munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+	munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+static int uring_open(struct io_dev *dev)
+{
+    struct io_uring_params p;
+    struct uring *ring;
+    unsigned char *sq, *cq;
+    int saved;
+
+    memset(&p, 0, sizeof(p));
+    ring = alloc(sizeof(struct uring));
+    memset(ring, 0, sizeof(struct uring));
+    if ((ring->fd = syscall(__NR_io_uring_setup, IO_DEPTH, &p)) < 0) {
+	free(ring);
+	return -1;
+    }
+    ring->entries = p.sq_entries < IO_DEPTH ? p.sq_entries : IO_DEPTH;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes +
+	p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring->cq_ring_size > ring->sq_ring_size)
+	    ring->sq_ring_size = ring->cq_ring_size;
+	ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+	ring->sq_ring = NULL;
+	goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	ring->cq_ring = ring->sq_ring;
+    else {
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED) {
+	    ring->cq_ring = NULL;
+	    goto fail;
+	}
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+	ring->sqes = NULL;
+	goto fail;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    dev->state = ring;
+    return 0;
+
+fail:
+    saved = errno;
+    uring_unmap(ring);
+    errno = saved;
+    return -1;
+}
+
+static void uring_submit(struct io_dev *dev, struct io_request *req, int n)
+{
+    struct uring *ring = dev->state;
+    struct iovec *iov;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned int tail, head, index, queued, in_flight;
+    int next, done, got;
+
+    iov = alloc(n * sizeof(struct iovec));
+    next = done = 0;
+    queued = in_flight = 0;
+    while (done < n) {
+	tail = *ring->sq_tail;
+	while (next < n && in_flight < ring->entries) {
+	    index = tail & *ring->sq_mask;
+	    sqe = &ring->sqes[index];
+	    memset(sqe, 0, sizeof(*sqe));
+	    iov[next].iov_base = req[next].data;
+	    iov[next].iov_len = req[next].size;
+	    sqe->opcode = req[next].write ? IORING_OP_WRITEV : IORING_OP_READV;
+	    sqe->fd = dev->fd;
+	    sqe->off = req[next].pos;
+	    sqe->addr = (uintptr_t)&iov[next];
+	    sqe->len = 1;
+	    sqe->user_data = next;
+	    ring->sq_array[index] = index;
+	    tail++;
+	    next++;
+	    queued++;
+	    in_flight++;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	/* Wait for everything once there is nothing left to queue */
+	got = syscall(__NR_io_uring_enter, ring->fd, queued,
+		      next < n ? 1 : in_flight, IORING_ENTER_GETEVENTS, NULL, 0);
+	dev->calls++;
+	if (got < 0) {
+	    if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+		continue;
+	    pdie("Submitting %u requests", queued);
+	}
+	queued -= got;
+
+	head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+	    cqe = &ring->cqes[head & *ring->cq_mask];
+	    req[cqe->user_data].result = cqe->res;
+	    head++;
+	    in_flight--;
+	    done++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    free(iov);
+}
+
+static void uring_close(struct io_dev *dev)
+{
+    uring_unmap(dev->state);
+}
+
+static const struct io_backend uring_backend = {
+    "io_uring", uring_open, posix_read, posix_write, uring_submit,
+    posix_flush, uring_close
+};
+
+#endif /* USE_IO_URING */
+
+
+static const struct io_backend *backends[] = {
+#ifdef USE_IO_URING
+    &uring_backend,
+#endif
+    &posix_backend,
+    NULL
+};
+
+/* NULL picks the first backend that works */
+static const struct io_backend *selected;
+
+int io_select(const char *name)
+{
+    int i;
+
+    if (!strcmp(name, "auto")) {
+	selected = NULL;
+	return 0;
+    }
+    for (i = 0; backends[i]; i++)
+	if (!strcmp(name, backends[i]->name)) {
+	    selected = backends[i];
+	    return 0;
+	}
+    return -1;
+}
+
+const char *io_backends(void)
+{
+#ifdef USE_IO_URING
+    return "posix, io_uring";
+#else
+    return "posix";
+#endif
+}
+
+struct io_dev *io_attach(int fd)
+{
+    struct io_dev *dev;
+    int i;
+
+    dev = alloc(sizeof(struct io_dev));
+    dev->fd = fd;
+    dev->state = NULL;
+    dev->calls = 0;
+    if (selected && selected->open(dev) == 0) {
+	dev->backend = selected;
+	return dev;
+    }
+    for (i = 0; backends[i]; i++)
+	if (backends[i]->open(dev) == 0) {
+	    dev->backend = backends[i];
+	    return dev;
+	}
+    die("No usable I/O backend");
+}
+
+ssize_t io_read(struct io_dev *dev, void *data, size_t size, off_t pos)
+{
+    dev->calls++;
+    return dev->backend->read(dev, data, size, pos);
+}
+
+ssize_t io_write(struct io_dev *dev, const void *data, size_t size,
+		 off_t pos)
+{
+    dev->calls++;
+    return dev->backend->write(dev, data, size, pos);
+}
+
+void io_submit(struct io_dev *dev, struct io_request *req, int n)
+{
+    ssize_t did;
+    int i;
+
+    if (n <= 0)
+	return;
+    dev->backend->submit(dev, req, n);
+
+    /* Complete short transfers, which are allowed to happen anywhere */
+    for (i = 0; i < n; i++)
+	while (req[i].result >= 0 && (size_t)req[i].result < req[i].size) {
+	    if (req[i].write)
+		did = io_write(dev, (char *)req[i].data + req[i].result,
+			       req[i].size - req[i].result,
+			       req[i].pos + req[i].result);
+	    else
+		did = io_read(dev, (char *)req[i].data + req[i].result,
+			      req[i].size - req[i].result,
+			      req[i].pos + req[i].result);
+	    if (did < 0)
+		req[i].result = -errno;
+	    if (did <= 0)
+		break;
+	    req[i].result += did;
+	}
+}
+
+int io_flush(struct io_dev *dev)
+{
+    return dev->backend->flush(dev);
+}
+
+void io_detach(struct io_dev *dev)
+{
+    dev->backend->close(dev);
+    free(dev);
+}
@@ -0,0 +1,111 @@
+/* io_backend.h - Device access backends
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+   The complete text of the GNU General Public License
+   can be found in /usr/share/common-licenses/GPL-3 file.
+*/
+
+#ifndef _IO_BACKEND_H
+#define _IO_BACKEND_H
+
+#include <sys/types.h>
+
+/* Maximum number of requests a backend keeps in flight at the same time */
+#define IO_DEPTH 64
+
+struct io_request {
+    off_t pos;
+    void *data;
+    size_t size;
+    int write;			/* 0 to read into DATA, 1 to write from it */
+    ssize_t result;		/* bytes transferred, or -errno on failure */
+};
+
+struct io_dev;
+
+struct io_backend {
+    const char *name;
+
+    /* Prepares DEV->fd for use with this backend. Returns 0 on success or
+     * -1 with errno set if the backend is not usable. */
+    int (*open)(struct io_dev *dev);
+
+    /* Like pread() and pwrite(). */
+    ssize_t (*read)(struct io_dev *dev, void *data, size_t size, off_t pos);
+    ssize_t (*write)(struct io_dev *dev, const void *data, size_t size,
+		     off_t pos);
+
+    /* Performs N requests and sets their result fields. The requests may
+     * complete in any order, so they must not overlap if any of them is a
+     * write. */
+    void (*submit)(struct io_dev *dev, struct io_request *req, int n);
+
+    /* Like fsync(). */
+    int (*flush)(struct io_dev *dev);
+
+    /* Releases the backend state. Does not close DEV->fd. */
+    void (*close)(struct io_dev *dev);
+};
+
+struct io_dev {
+    int fd;
+    const struct io_backend *backend;
+    void *state;		/* private to the backend */
+    unsigned long calls;	/* system calls issued for data transfers */
+};
+
+int io_select(const char *name);
+
+/* Selects the backend used by io_attach. NAME is "posix", "io_uring" or
+   "auto", which picks the fastest backend that works at runtime. Returns 0 on
+   success, -1 if NAME is not a known backend. */
+
+const char *io_backends(void);
+
+/* Returns a comma separated list of the backends compiled in. */
+
+struct io_dev *io_attach(int fd);
+
+/* Sets up the selected backend for the open file descriptor FD and returns a
+   handle for it. Falls back to the POSIX backend if the selected one does not
+   work for FD. */
+
+ssize_t io_read(struct io_dev *dev, void *data, size_t size, off_t pos);
+
+/* Reads up to SIZE bytes at POS into DATA. Returns the number of bytes read,
+   or -1 with errno set. */
+
+ssize_t io_write(struct io_dev *dev, const void *data, size_t size,
+		 off_t pos);
+
+/* Writes up to SIZE bytes from DATA at POS. Returns the number of bytes
+   written, or -1 with errno set. */
+
+void io_submit(struct io_dev *dev, struct io_request *req, int n);
+
+/* Performs the N requests in REQ, keeping as many of them in flight as the
+   backend allows, and stores the outcome of each in its result field. Short
+   transfers are only reported at the end of the device. */
+
+int io_flush(struct io_dev *dev);
+
+/* Makes sure all data written has reached the device. Returns 0 on success,
+   -1 with errno set otherwise. */
+
+void io_detach(struct io_dev *dev);
+
+/* Releases DEV. The file descriptor is left open. */
+
+#endif
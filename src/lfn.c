@@ -56,6 +56,7 @@ unsigned char lfn_checksum;
 int lfn_slot = -1;
 off_t *lfn_offsets = NULL;
 int lfn_parts = 0;
+static void *lfn_queue;		/* lfn_unicode and lfn_offsets, until lfn_reset */
 
 static unsigned char fat_uni2esc[64] = {
     '0', '1', '2', '3', '4', '5', '6', '7',
@@ -186,11 +187,8 @@ void lfn_fix_checksum(off_t from, off_t to, const char *short_name)
 
 void lfn_reset(void)
 {
-    if (lfn_unicode)
-	free(lfn_unicode);
+    qreset(&lfn_queue);
     lfn_unicode = NULL;
-    if (lfn_offsets)
-	free(lfn_offsets);
     lfn_offsets = NULL;
     lfn_slot = -1;
 }
@@ -250,8 +248,8 @@ void lfn_add_slot(DIR_ENT * de, off_t dir_offset)
 	}
 	lfn_slot = slot;
 	lfn_checksum = lfn->alias_checksum;
-	lfn_unicode = alloc((lfn_slot * CHARS_PER_LFN + 1) * 2);
-	lfn_offsets = alloc(lfn_slot * sizeof(off_t));
+	lfn_unicode = qalloc(&lfn_queue, (lfn_slot * CHARS_PER_LFN + 1) * 2);
+	lfn_offsets = qalloc(&lfn_queue, lfn_slot * sizeof(off_t));
 	lfn_parts = 0;
     } else if (lfn_slot == -1 && slot != 0) {
 	/* No LFN in progress, but slot found; start bit missing */
@@ -270,7 +268,7 @@ void lfn_add_slot(DIR_ENT * de, off_t dir_offset)
 			   3, "Set start bit")) {
 	case 1:
 	    if (!lfn_offsets)
-		lfn_offsets = alloc(sizeof(off_t));
+		lfn_offsets = qalloc(&lfn_queue, sizeof(off_t));
 	    lfn_offsets[0] = dir_offset;
 	    clear_lfn_slots(0, 0);
 	    lfn_reset();
@@ -284,8 +282,9 @@ void lfn_add_slot(DIR_ENT * de, off_t dir_offset)
 		     sizeof(lfn->id), &lfn->id);
 	    lfn_slot = slot;
 	    lfn_checksum = lfn->alias_checksum;
-	    lfn_unicode = alloc((lfn_slot * CHARS_PER_LFN + 1) * 2);
-	    lfn_offsets = alloc(lfn_slot * sizeof(off_t));
+	    lfn_unicode = qalloc(&lfn_queue,
+				 (lfn_slot * CHARS_PER_LFN + 1) * 2);
+	    lfn_offsets = qalloc(&lfn_queue, lfn_slot * sizeof(off_t));
 	    lfn_parts = 0;
 	    break;
 	}
@@ -314,7 +313,7 @@ void lfn_add_slot(DIR_ENT * de, off_t dir_offset)
 			   3, "Correct sequence number")) {
 	case 1:
 	    if (!lfn_offsets) {
-		lfn_offsets = alloc(sizeof(off_t));
+		lfn_offsets = qalloc(&lfn_queue, sizeof(off_t));
 		lfn_parts = 0;
 	    }
 	    lfn_offsets[lfn_parts++] = dir_offset;
@@ -509,6 +508,38 @@ char *lfn_get(DIR_ENT * de, off_t * lfn_offset)
     return (lfn);
 }
 
+/* Returns the long name that the COUNT slots at SLOTS give to the short
+ * entry DE following them, if lfn_add_slot() and lfn_get() would take them
+ * as they are, or NULL otherwise. The name is allocated with alloc(). Unlike
+ * those, it keeps no state, so threads may call it. */
+char *lfn_assemble(const DIR_ENT * slots, int count, const DIR_ENT * de)
+{
+    LFN_ENT *lfn = (LFN_ENT *) slots;
+    unsigned char *unicode;
+    char *name;
+    uint8_t sum;
+    int i;
+
+    for (sum = 0, i = 0; i < MSDOS_NAME; i++)
+	sum = (((sum & 1) << 7) | ((sum & 0xfe) >> 1)) + de->name[i];
+    /* Only the first slot starts the name, and the numbers count down */
+    for (i = 0; i < count; i++)
+	if ((i ? lfn[i].id & LFN_ID_START : !(lfn[i].id & LFN_ID_START)) ||
+	    (lfn[i].id & LFN_ID_SLOTMASK) != count - i ||
+	    lfn[i].alias_checksum != sum || lfn[i].reserved ||
+	    lfn[i].start != htole16(0))
+	    return NULL;
+
+    unicode = alloc((count * CHARS_PER_LFN + 1) * 2);
+    for (i = 0; i < count; i++)
+	copy_lfn_part(unicode + (count - 1 - i) * CHARS_PER_LFN * 2, &lfn[i]);
+    unicode[count * CHARS_PER_LFN * 2] = 0;
+    unicode[count * CHARS_PER_LFN * 2 + 1] = 0;
+    name = cnv_unicode(unicode, UNTIL_0, 0);
+    free(unicode);
+    return name;
+}
+
 void lfn_check_orphaned(void)
 {
     char *long_name;
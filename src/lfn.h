@@ -34,6 +34,8 @@ char *lfn_get(DIR_ENT * de, off_t * lfn_offset);
 
 void lfn_check_orphaned(void);
 
+char *lfn_assemble(const DIR_ENT * slots, int count, const DIR_ENT * de);
+
 void lfn_fix_checksum(off_t from, off_t to, const char *short_name);
 
 #endif
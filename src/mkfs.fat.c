@@ -68,6 +68,7 @@
 #include "common.h"
 #include "msdos_fs.h"
 #include "device_info.h"
+#include "io_backend.h"
 #include "charconv.h"
 
 
@@ -249,6 +250,7 @@ static int nr_fats = 2;		/* Default number of FATs to produce */
 static int size_fat = 0;	/* Size in bits of FAT entries */
 static int size_fat_by_user = 0;	/* 1 if FAT size user selected */
 static int dev = -1;		/* FS block device file handle */
+static struct io_dev *io;	/* I/O backend used for dev */
 static off_t part_sector = 0; /* partition offset in sector */
 static int ignore_safety_checks = 0;	/* Ignore safety checks */
 static struct msdos_boot_sector bs;	/* Boot sector data */
@@ -387,20 +389,31 @@ static int mark_FAT_sector(int sector, unsigned int value)
     return mark_FAT_cluster(cluster, value);
 }
 
-/* Perform a test on a block.  Return the number of blocks that could be read successfully */
+/* Perform a test on a run of blocks, reading up to IO_DEPTH chunks of TEST_BUFFER_BLOCKS blocks
+   in parallel.  Return the number of blocks that could be read successfully */
 
 static long do_check(int try, off_t current_block)
 {
-    static char buffer[BLOCK_SIZE * TEST_BUFFER_BLOCKS];
+    static char buffer[BLOCK_SIZE * TEST_BUFFER_BLOCKS * IO_DEPTH];
+    struct io_request req[IO_DEPTH];
     long got;
+    int i, n;
+
+    for (n = 0; n * TEST_BUFFER_BLOCKS < try; n++) {
+	req[n].pos = part_sector * sector_size +
+	    (current_block + n * TEST_BUFFER_BLOCKS) * BLOCK_SIZE;
+	req[n].data = buffer + n * TEST_BUFFER_BLOCKS * BLOCK_SIZE;
+	req[n].size = min(try - n * TEST_BUFFER_BLOCKS, TEST_BUFFER_BLOCKS) * BLOCK_SIZE;
+	req[n].write = 0;
+    }
+    io_submit(io, req, n);	/* Try reading! */
 
-    if (lseek(dev, part_sector * sector_size + current_block * BLOCK_SIZE, SEEK_SET)	/* Seek to the correct location */
-	!=current_block * BLOCK_SIZE)
-	die("seek failed during testing for blocks");
-
-    got = read(dev, buffer, try * BLOCK_SIZE);	/* Try reading! */
-    if (got < 0)
-	got = 0;
+    /* Only count the blocks before the first error */
+    for (got = i = 0; i < n && req[i].result >= 0; i++) {
+	got += req[i].result;
+	if (req[i].result != req[i].size)
+	    break;
+    }
 
     if (got & (BLOCK_SIZE - 1))
 	printf("Unexpected values in do_check: probably bugs\n");
@@ -442,7 +455,7 @@ static void check_blocks(void)
 	else
 	    alarm(5);
     }
-    try = TEST_BUFFER_BLOCKS;
+    try = TEST_BUFFER_BLOCKS * IO_DEPTH;
     while (currently_testing < blocks) {
 	if (display_status) {
 	    display_status = 0;
@@ -455,7 +468,7 @@ static void check_blocks(void)
 	got = do_check(try, currently_testing);
 	currently_testing += got;
 	if (got == try) {
-	    try = TEST_BUFFER_BLOCKS;
+	    try = TEST_BUFFER_BLOCKS * IO_DEPTH;
 	    continue;
 	} else
 	    try = 1;
@@ -1382,26 +1395,54 @@ static void setup_tables(void)
 
 /* Write the new filesystem's data tables to wherever they're going to end up! */
 
-#define error(str)				\
+#define error(...)				\
   do {						\
     free (fat);					\
     free (info_sector_buffer);			\
     free (root_dir);				\
-    die (str);					\
+    die (__VA_ARGS__);				\
   } while(0)
 
+/* The writes are queued and handed to the I/O backend in batches, so they can
+   be in flight at the same time. Writes that overlap must be separated by a
+   call to sync_writes(). */
+
+static struct io_request write_queue[IO_DEPTH];
+static const char *write_what[IO_DEPTH];
+static int write_count;
+static off_t write_pos;
+
+static void sync_writes(void)
+{
+    int i;
+
+    io_submit(io, write_queue, write_count);
+    for (i = 0; i < write_count; i++)
+	if (write_queue[i].result != write_queue[i].size)
+	    error("failed whilst writing %s", write_what[i]);
+    write_count = 0;
+}
+
+static void queue_write(void *buf, int size, const char *what)
+{
+    if (write_count == IO_DEPTH)
+	sync_writes();
+    write_queue[write_count].pos = write_pos;
+    write_queue[write_count].data = buf;
+    write_queue[write_count].size = size;
+    write_queue[write_count].write = 1;
+    write_what[write_count++] = what;
+    write_pos += size;
+}
+
 #define seekto(pos,errstr)						\
   do {									\
-    off_t __pos = (pos);						\
-    if (lseek (dev, part_sector * sector_size + __pos, SEEK_SET) != part_sector * sector_size + __pos)				\
-	error ("seek to " errstr " failed whilst writing tables");	\
+    write_pos = part_sector * sector_size + (pos);			\
   } while(0)
 
 #define writebuf(buf,size,errstr)			\
   do {							\
-    int __size = (size);				\
-    if (write (dev, buf, __size) != __size)		\
-	error ("failed whilst writing " errstr);	\
+    queue_write(buf, size, errstr);			\
   } while(0)
 
 static void process_bad_blocks(void)
@@ -1445,6 +1486,7 @@ static void write_tables(void)
     /* clear all reserved sectors */
     for (x = 0; x < reserved_sectors; ++x)
 	writebuf(blank_sector, sector_size, "reserved sector");
+    sync_writes();
     /* seek back to sector 0 and write the boot sector */
     seekto(0, "boot sector");
     writebuf((char *)&bs, sizeof(struct msdos_boot_sector), "boot sector");
@@ -1481,6 +1523,7 @@ static void write_tables(void)
 	seekto(root_sector * sector_size, "root sector");
     }
     writebuf((char *)root_dir, size_root_dir, "root directory");
+    sync_writes();
 
     if (blank_sector)
 	free(blank_sector);
@@ -1525,6 +1568,7 @@ static void usage(const char *name, int exitval)
     fprintf(stderr, "  --variant=TYPE  Select variant TYPE of filesystem (standard or Atari)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "  --offset=SECTOR Write the filesystem at a specific sector into the device file.\n");
+    fprintf(stderr, "  --io=NAME       Use I/O backend NAME: auto (default), %s\n", io_backends());
     fprintf(stderr, "  --help          Show this help message and exit\n");
     exit(exitval);
 }
@@ -1548,13 +1592,14 @@ int main(int argc, char **argv)
     char *source_date_epoch = NULL;
     long codepage = -1;
 
-    enum {OPT_HELP=1000, OPT_INVARIANT, OPT_MBR, OPT_VARIANT, OPT_CODEPAGE, OPT_OFFSET};
+    enum {OPT_HELP=1000, OPT_INVARIANT, OPT_MBR, OPT_VARIANT, OPT_CODEPAGE, OPT_OFFSET, OPT_IO};
     const struct option long_options[] = {
 	    {"codepage",  required_argument, NULL, OPT_CODEPAGE},
 	    {"invariant", no_argument,       NULL, OPT_INVARIANT},
 	    {"mbr",       optional_argument, NULL, OPT_MBR},
 	    {"variant",   required_argument, NULL, OPT_VARIANT},
 	    {"offset",    required_argument, NULL, OPT_OFFSET},
+	    {"io",        required_argument, NULL, OPT_IO},
 	    {"help",      no_argument,       NULL, OPT_HELP},
 	    {0,}
     };
@@ -1894,6 +1939,13 @@ int main(int argc, char **argv)
         part_sector = (off_t) conversion;
         break;
 
+	case OPT_IO:
+	    if (io_select(optarg) < 0) {
+		printf("Unknown I/O backend: %s\n", optarg);
+		usage(argv[0], 1);
+	    }
+	    break;
+
 	case '?':
 	    usage(argv[0], 1);
 	    break;
@@ -1958,6 +2010,8 @@ int main(int argc, char **argv)
 	    pdie("unable to resize %s", device_name);
     }
 
+    io = io_attach(dev);
+
     if (get_device_info(dev, &devinfo) < 0)
 	die("error collecting information about %s", device_name);
 
@@ -2032,7 +2086,7 @@ int main(int argc, char **argv)
 
     /* Let's make sure to sync the block device. Otherwise, if we operate on a loop device and people issue
      * "losetup -d" right after this command finishes our in-flight writes might never hit the disk */
-    if (fsync(dev) < 0)
+    if (io_flush(io) < 0)
         pdie("unable to synchronize %s", device_name);
 
     exit(0);			/* Terminate with no errors! */
@@ -0,0 +1,369 @@
+/* readahead.c - Read and parse the directory tree ahead of the check in threads
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+   The complete text of the GNU General Public License
+   can be found in /usr/share/common-licenses/GPL-3 file.
+*/
+
+/*
+ * The check walks the directory tree depth first, one directory after the
+ * other. With -n, most directories need no repairs, and for those most of
+ * the work depends on nothing but their entries and the FAT: reading the
+ * clusters, putting the long names together, checking the short names and
+ * following the cluster chains. The threads here do that work further down
+ * the tree, each taking the next directory from a shared stack and pushing
+ * its subdirectories in reverse, so that they are taken in the order the
+ * check gets to them. The check takes their results in tree order and only
+ * claims the clusters itself, so its output stays the same.
+ *
+ * The threads look at the FAT in memory and at the bitmaps that come with
+ * it, so nothing may change while they run. Whatever needs a repair makes
+ * the check stop them and go on by itself. A bitmap of the directories taken
+ * up keeps the threads out of loops, and they stay a window of directories
+ * ahead of the check so that their results don't pile up.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "common.h"
+#include "fsck.fat.h"
+#include "io.h"
+#include "fat.h"
+#include "readahead.h"
+
+void readahead_release(AHEAD_DIR * dir)
+{
+    uint32_t i;
+
+    for (i = 0; i < dir->files; i++)
+	free(dir->file[i].lfn);
+    free(dir->file);
+    free(dir->extent);
+    free(dir);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/* Number of directories the threads may parse ahead of the check */
+#define READAHEAD_WINDOW 1024
+
+static DOS_FS *tree_fs;
+static AHEAD_PARSE *tree_parse;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;	/* the threads */
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;	/* the check */
+static pthread_t thread[READAHEAD_MAX_THREADS];
+static int threads, stop;
+
+/* All of the following is protected by LOCK */
+static AHEAD_DIR **stack;
+static uint32_t stack_size, stack_max;
+static uint32_t *seen;		/* one bit per cluster a directory starts at */
+static AHEAD_DIR **bucket;	/* directories taken up, not handed out yet */
+static uint32_t buckets, hashed;
+static unsigned long parsed_dirs, checked_dirs;
+static AHEAD_DIR *wanted;	/* directory the check waits for */
+
+/* Marks CLUSTER as seen and returns whether it was seen before. */
+static int mark_seen(uint32_t cluster)
+{
+    uint32_t bit = 1U << cluster % 32;
+
+    if (seen[cluster / 32] & bit)
+	return 1;
+    seen[cluster / 32] |= bit;
+    return 0;
+}
+
+static void hash_add(AHEAD_DIR * dir)
+{
+    AHEAD_DIR **grown, *walk, *next;
+    uint32_t i, size;
+
+    if (hashed == buckets) {
+	size = buckets ? buckets * 2 : 1024;
+	grown = alloc(size * sizeof(AHEAD_DIR *));
+	memset(grown, 0, size * sizeof(AHEAD_DIR *));
+	for (i = 0; i < buckets; i++)
+	    for (walk = bucket[i]; walk; walk = next) {
+		next = walk->next;
+		walk->next = grown[walk->cluster & (size - 1)];
+		grown[walk->cluster & (size - 1)] = walk;
+	    }
+	free(bucket);
+	bucket = grown;
+	buckets = size;
+    }
+    dir->next = bucket[dir->cluster & (buckets - 1)];
+    bucket[dir->cluster & (buckets - 1)] = dir;
+    hashed++;
+}
+
+/* Removes the directory starting at CLUSTER from the hash and returns it, or
+ * NULL if it is not there. */
+static AHEAD_DIR *hash_take(uint32_t cluster)
+{
+    AHEAD_DIR **link, *dir;
+
+    if (!buckets)
+	return NULL;
+    for (link = &bucket[cluster & (buckets - 1)]; (dir = *link);
+	 link = &dir->next)
+	if (dir->cluster == cluster) {
+	    *link = dir->next;
+	    hashed--;
+	    return dir;
+	}
+    return NULL;
+}
+
+/* Takes up the directory starting at CLUSTER, unless it was taken up before. */
+static void push_dir(uint32_t cluster, uint32_t parent)
+{
+    AHEAD_DIR **grown, *dir;
+
+    if (cluster < 2 || cluster >= tree_fs->data_clusters + 2 ||
+	mark_seen(cluster))
+	return;
+    dir = alloc(sizeof(AHEAD_DIR));
+    memset(dir, 0, sizeof(AHEAD_DIR));
+    dir->cluster = cluster;
+    dir->parent = parent;
+    hash_add(dir);
+    if (stack_size == stack_max) {
+	stack_max = stack_max ? stack_max * 2 : 64;
+	grown = alloc(stack_max * sizeof(AHEAD_DIR *));
+	if (stack) {
+	    memcpy(grown, stack, stack_size * sizeof(AHEAD_DIR *));
+	    free(stack);
+	}
+	stack = grown;
+    }
+    stack[stack_size++] = dir;
+}
+
+/* Reads all clusters of the directory starting at CLUSTER into *ENTRIES,
+ * which is *SIZE bytes large and grown as needed. Returns the number of
+ * entries, or -1 if the chain needs repairs or can't be read. */
+static int read_dir(uint32_t cluster, DIR_ENT ** entries, size_t * size)
+{
+    DOS_FS *fs = tree_fs;
+    FAT_ENTRY entry;
+    DIR_ENT *grown;
+    size_t used = 0, bytes;
+    uint32_t run;
+
+    while (1) {
+	/* Each extent is read at once */
+	run = chain_run(fs, cluster);
+	if (find_cyclic(fs, cluster, run) <= run)
+	    return -1;
+	bytes = (size_t)(run - cluster + 1) * fs->cluster_size;
+	if (used + bytes > INT32_MAX)
+	    return -1;
+	if (used + bytes > *size) {
+	    *size = *size * 2 > used + bytes ? *size * 2 : used + bytes;
+	    grown = alloc(*size);
+	    memcpy(grown, *entries, used);
+	    free(*entries);
+	    *entries = grown;
+	}
+	if (fs_read_shared(cluster_start(fs, cluster), bytes,
+			   (char *)*entries + used) != bytes)
+	    return -1;
+	used += bytes;
+	get_fat(&entry, fs->fat, run, fs);
+	if (FAT_IS_EOF(fs, entry.value))
+	    return used / sizeof(DIR_ENT);
+	if (entry.value < 2 || entry.value >= fs->data_clusters + 2)
+	    return -1;
+	cluster = entry.value;
+    }
+}
+
+static void *parse_tree(void *arg)
+{
+    DOS_FS *fs = tree_fs;
+    DIR_ENT *entries = NULL;
+    size_t size = 0;
+    AHEAD_DIR *dir;
+    uint32_t i;
+    int count;
+
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (1) {
+	while (!stop && (!stack_size ||
+			 (parsed_dirs >= checked_dirs + READAHEAD_WINDOW &&
+			  !wanted)))
+	    pthread_cond_wait(&wake, &lock);
+	if (stop)
+	    break;
+	dir = stack[--stack_size];
+	parsed_dirs++;
+	pthread_mutex_unlock(&lock);
+
+	if ((count = read_dir(dir->cluster, &entries, &size)) >= 0)
+	    tree_parse(fs, dir, entries, count);
+
+	pthread_mutex_lock(&lock);
+	if (dir->clean)
+	    for (i = dir->files; i--;)
+		if (dir->file[i].dir_ent.attr & ATTR_DIR)
+		    push_dir(dir->file[i].start,
+			     dir->cluster == fs->root_cluster ? 0 :
+			     dir->cluster);
+	dir->done = 1;
+	if (dir == wanted)
+	    pthread_cond_signal(&ready);
+	if (stack_size)
+	    pthread_cond_broadcast(&wake);
+    }
+    pthread_mutex_unlock(&lock);
+
+    free(entries);
+    return NULL;
+}
+
+void readahead_start(DOS_FS * fs, int count, const uint32_t * dirs, int n,
+		     AHEAD_PARSE * parse)
+{
+    uint32_t words = (fs->data_clusters + 2 + 31) / 32;
+
+    readahead_stop();
+    if (!count)
+	return;
+    tree_fs = fs;
+    tree_parse = parse;
+    seen = alloc(words * sizeof(uint32_t));
+    memset(seen, 0, words * sizeof(uint32_t));
+    parsed_dirs = checked_dirs = 0;
+    stop = 0;
+    while (n--)
+	push_dir(dirs[n], 0);
+    /* Run with the threads that could be started */
+    for (threads = 0; threads < count; threads++)
+	if (pthread_create(&thread[threads], NULL, parse_tree, NULL))
+	    break;
+    if (!threads)
+	readahead_stop();
+}
+
+AHEAD_DIR *readahead_get(uint32_t cluster)
+{
+    AHEAD_DIR *dir;
+    uint32_t i;
+
+    if (!threads)
+	return NULL;
+    pthread_mutex_lock(&lock);
+    if ((dir = hash_take(cluster))) {
+	/* Threads that got as far ahead as they may are woken only once the
+	   check caught up half the way, so that they parse in batches */
+	if (++checked_dirs + READAHEAD_WINDOW / 2 == parsed_dirs && stack_size)
+	    pthread_cond_broadcast(&wake);
+	if (!dir->done) {
+	    /* Have it taken next if no thread did yet */
+	    for (i = stack_size; i--;)
+		if (stack[i] == dir) {
+		    memmove(&stack[i], &stack[i + 1],
+			    (stack_size - i - 1) * sizeof(AHEAD_DIR *));
+		    stack[stack_size - 1] = dir;
+		    break;
+		}
+	    wanted = dir;
+	    pthread_cond_broadcast(&wake);
+	    while (!dir->done)
+		pthread_cond_wait(&ready, &lock);
+	    wanted = NULL;
+	}
+    }
+    pthread_mutex_unlock(&lock);
+    if (dir && dir->clean)
+	return dir;
+    if (dir)
+	readahead_release(dir);
+    readahead_stop();
+    return NULL;
+}
+
+void readahead_stop(void)
+{
+    AHEAD_DIR *dir;
+    uint32_t i;
+
+    if (!seen)
+	return;
+    pthread_mutex_lock(&lock);
+    stop = 1;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < threads; i++)
+	pthread_join(thread[i], NULL);
+    threads = 0;
+    /* Every directory taken up and not handed out is in the hash */
+    for (i = 0; i < buckets; i++)
+	while ((dir = bucket[i])) {
+	    bucket[i] = dir->next;
+	    readahead_release(dir);
+	}
+    free(bucket);
+    bucket = NULL;
+    buckets = hashed = 0;
+    free(stack);
+    stack = NULL;
+    stack_size = stack_max = 0;
+    free(seen);
+    seen = NULL;
+}
+
+#else
+
+void readahead_start(DOS_FS * fs, int count, const uint32_t * dirs, int n,
+		     AHEAD_PARSE * parse)
+{
+    (void)fs;
+    (void)count;
+    (void)dirs;
+    (void)n;
+    (void)parse;
+}
+
+AHEAD_DIR *readahead_get(uint32_t cluster)
+{
+    (void)cluster;
+    return NULL;
+}
+
+void readahead_stop(void)
+{
+}
+
+#endif
+
+int readahead_supported(void)
+{
+#ifdef HAVE_PTHREAD_H
+    return 1;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,89 @@
+/* readahead.h - Read and parse the directory tree ahead of the check in threads
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+   The complete text of the GNU General Public License
+   can be found in /usr/share/common-licenses/GPL-3 file.
+*/
+
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+#include "fsck.fat.h"
+
+/* Largest number of jobs -j accepts, one of them is the check itself */
+#define READAHEAD_MAX_THREADS 64
+
+/* What a thread found out about a file in a directory */
+typedef struct {
+    DIR_ENT dir_ent;
+    off_t offset;		/* of the directory entry */
+    char *lfn;			/* long name, NULL if there is none */
+    off_t lfn_offset;		/* of the first slot of the long name */
+    uint32_t start;		/* first cluster */
+    uint32_t extent;		/* first of its extents in the directory's list */
+    uint32_t extents;		/* number of extents of its cluster chain */
+} AHEAD_FILE;
+
+/* What a thread found out about a directory */
+typedef struct _ahead_dir {
+    uint32_t cluster;		/* first cluster */
+    uint32_t parent;		/* first cluster of the parent, 0 for the root */
+    int clean;			/* nothing to repair but cross-links */
+    AHEAD_FILE *file;		/* files in the order of their entries */
+    uint32_t files;
+    uint32_t *extent;		/* first and last cluster of each extent */
+    uint32_t extents;
+    int done;			/* the threads are through with it */
+    struct _ahead_dir *next;	/* in the same hash bucket */
+} AHEAD_DIR;
+
+/* Fills in DIR from the COUNT entries at ENTRIES, the contents of all of its
+   clusters. Runs in the threads, so it may look at nothing but the entries
+   and the FAT in memory. Only the subdirectories of clean directories are
+   read. */
+typedef void AHEAD_PARSE(DOS_FS * fs, AHEAD_DIR * dir, const DIR_ENT * entries,
+			 int count);
+
+void readahead_start(DOS_FS * fs, int threads, const uint32_t * dirs,
+		     int count, AHEAD_PARSE * parse);
+
+/* Starts THREADS threads that read and PARSE the COUNT directories starting
+   at the clusters in DIRS, the subdirectories of the root directory in the
+   order the check gets to them, and the directories below them. Does nothing
+   if THREADS is zero or the program was built without threads. Nothing may
+   change the filesystem, the FAT in memory included, until they are stopped
+   again. */
+
+AHEAD_DIR *readahead_get(uint32_t cluster);
+
+/* Returns what the threads found out about the directory starting at
+   CLUSTER, waiting for them if they are not through with it yet. If they did
+   not get to it or found it in need of repairs, it stops them and returns
+   NULL. The check has to call readahead_release() for the directory. */
+
+void readahead_release(AHEAD_DIR * dir);
+
+/* Frees DIR and everything found out about it. */
+
+void readahead_stop(void);
+
+/* Stops the threads started by readahead_start and waits for them. */
+
+int readahead_supported(void);
+
+/* Returns whether the program was built with threads, so that
+   readahead_start() can start any. */
+
+#endif